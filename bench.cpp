@@ -0,0 +1,335 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "overthrower.h"
+
+// Self-contained microbenchmark of the per-call overhead of overthrower.
+// Every scenario is a set of environment variables which is applied right before activateOverthrower is invoked.
+// Results are printed to stdout as JSON, so they can be collected and compared across releases and backends,
+// progress is printed to stderr (together with messages of overthrower itself).
+//
+// Usage: overthrower_bench [--label <text>] [--iterations <count>] [--threads <count>[,<count>...]] [--scenario <name>]
+
+static void* (*volatile forced_memset)(void*, int, size_t) = memset;
+
+struct Scenario {
+    const char* name;
+    const char* strategy; // nullptr - overthrower is not activated at all.
+    const char* parameters[4]; // NAME=VALUE pairs, nullptr terminated.
+    bool paused;
+    unsigned int iteration_divisor; // Expensive scenarios (printing of every allocation) use fewer iterations.
+};
+
+static const Scenario g_scenarios[] = {
+    { "dormant", nullptr, { nullptr }, false, 1U },
+    { "none", "3", { nullptr }, false, 1U },
+    { "random", "0", { "OVERTHROWER_SEED=0", "OVERTHROWER_DUTY_CYCLE=4096", nullptr }, false, 1U },
+    { "step", "1", { "OVERTHROWER_DELAY=1000000", nullptr }, false, 1U },
+    { "pulse", "2", { "OVERTHROWER_DELAY=1000", "OVERTHROWER_DURATION=100", nullptr }, false, 1U },
+    { "step_batched", "1", { "OVERTHROWER_DELAY=1000000", "OVERTHROWER_SEQUENCE=1", nullptr }, false, 1U },
+    { "step_thread", "1", { "OVERTHROWER_DELAY=1000000", "OVERTHROWER_SEQUENCE=2", nullptr }, false, 1U },
+    { "sampled", "3", { "OVERTHROWER_SAMPLE_RATE=524288", nullptr }, false, 1U },
+    { "paused", "3", { nullptr }, true, 1U },
+    { "verbose_failed", "0", { "OVERTHROWER_SEED=0", "OVERTHROWER_DUTY_CYCLE=4096", "OVERTHROWER_VERBOSE=1", nullptr }, false, 1U },
+    { "verbose_all", "3", { "OVERTHROWER_VERBOSE=2", nullptr }, false, 100U },
+};
+
+static const char* const g_variables[] = { "OVERTHROWER_STRATEGY", "OVERTHROWER_SEED",    "OVERTHROWER_DUTY_CYCLE", "OVERTHROWER_DELAY",
+                                           "OVERTHROWER_DURATION", "OVERTHROWER_VERBOSE", "OVERTHROWER_REPORT_FILE",
+                                           "OVERTHROWER_SEQUENCE", "OVERTHROWER_SAMPLE_RATE" };
+
+enum Operation {
+    OPERATION_MALLOC_FREE,
+    OPERATION_REALLOC,
+    OPERATION_FREE_UNTRACKED,
+    OPERATION_NEW_DELETE,
+};
+
+static const char* const g_operation_names[] = { "malloc_free", "realloc", "free_untracked", "new_delete" };
+
+struct Result {
+    unsigned long long operations;
+    unsigned long long failures;
+};
+
+static const size_t g_sizes[] = { 16, 24, 32, 48, 64, 96, 128, 256, 512, 1024, 4096, 16384 };
+
+static Result runMallocFree(unsigned int iterations)
+{
+    Result result{};
+    for (unsigned int i = 0; i < iterations; ++i) {
+        const size_t size = g_sizes[i % (sizeof(g_sizes) / sizeof(g_sizes[0]))];
+        void* block = malloc(size);
+        if (block)
+            forced_memset(block, 0, 1);
+        else
+            ++result.failures;
+        free(block);
+        ++result.operations;
+    }
+    return result;
+}
+
+static Result runNewDelete(unsigned int iterations)
+{
+    Result result{};
+    for (unsigned int i = 0; i < iterations; ++i) {
+        const size_t size = g_sizes[i % (sizeof(g_sizes) / sizeof(g_sizes[0]))];
+        char* block = new (std::nothrow) char[size];
+        if (block)
+            forced_memset(block, 0, 1);
+        else
+            ++result.failures;
+        delete[] block;
+        ++result.operations;
+    }
+    return result;
+}
+
+static Result runRealloc(unsigned int iterations)
+{
+    // A buffer grows geometrically up to 64 KiB and starts from scratch, like a typical dynamic array.
+    Result result{};
+    void* buffer = nullptr;
+    size_t size = 0;
+    for (unsigned int i = 0; i < iterations; ++i) {
+        size = size && size < 65536 ? size * 2U : 16U;
+        void* new_buffer = realloc(buffer, size);
+        if (new_buffer) {
+            buffer = new_buffer;
+            forced_memset(buffer, 0, 1);
+        }
+        else {
+            ++result.failures;
+        }
+        ++result.operations;
+    }
+    free(buffer);
+    return result;
+}
+
+static Result runFreeUntracked(unsigned int iterations, std::vector<void*>& blocks)
+{
+    // Blocks are allocated before activation, so overthrower does not know anything about them.
+    Result result{};
+    for (unsigned int i = 0; i < iterations; ++i) {
+        free(blocks[i]);
+        ++result.operations;
+    }
+    blocks.clear();
+    return result;
+}
+
+static void applyScenario(const Scenario& scenario)
+{
+    for (const char* name : g_variables)
+        unsetenv(name);
+    if (!scenario.strategy)
+        return;
+    setenv("OVERTHROWER_STRATEGY", scenario.strategy, 1);
+    // Failed allocations and leaks are reported, but the report itself is not what is measured.
+    setenv("OVERTHROWER_REPORT_FILE", "/dev/null", 1);
+    for (const char* const* parameter = scenario.parameters; *parameter; ++parameter) {
+        const char* separator = strchr(*parameter, '=');
+        setenv(std::string(*parameter, separator).c_str(), separator + 1, 1);
+    }
+}
+
+static void benchmark(const Scenario& scenario,
+                      Operation operation,
+                      unsigned int thread_count,
+                      unsigned int iterations,
+                      const std::string& label,
+                      bool& is_first_result)
+{
+    std::vector<std::vector<void*>> untracked_blocks(thread_count);
+    if (operation == OPERATION_FREE_UNTRACKED) {
+        for (auto& blocks : untracked_blocks) {
+            blocks.resize(iterations);
+            for (void*& block : blocks)
+                block = malloc(64);
+        }
+    }
+
+    std::vector<Result> results(thread_count);
+    std::vector<std::thread> threads;
+    threads.reserve(thread_count);
+    std::atomic<unsigned int> ready_count{};
+    std::atomic<bool> start_flag{};
+
+    applyScenario(scenario);
+    const bool is_activated = scenario.strategy && activateOverthrower;
+    if (is_activated)
+        activateOverthrower();
+
+    // Threads are created while overthrower is paused, creating a thread is not a subject of this benchmark.
+    if (is_activated)
+        pauseOverthrower(0);
+    for (unsigned int i = 0; i < thread_count; ++i) {
+        threads.emplace_back([&, i]() {
+            if (scenario.paused && is_activated)
+                pauseOverthrower(0);
+            ++ready_count;
+            while (!start_flag.load(std::memory_order_acquire)) {
+            }
+            switch (operation) {
+                case OPERATION_MALLOC_FREE:
+                    results[i] = runMallocFree(iterations);
+                    break;
+                case OPERATION_REALLOC:
+                    results[i] = runRealloc(iterations);
+                    break;
+                case OPERATION_FREE_UNTRACKED:
+                    results[i] = runFreeUntracked(iterations, untracked_blocks[i]);
+                    break;
+                case OPERATION_NEW_DELETE:
+                    results[i] = runNewDelete(iterations);
+                    break;
+            }
+            if (scenario.paused && is_activated)
+                resumeOverthrower();
+        });
+    }
+    if (is_activated)
+        resumeOverthrower();
+
+    while (ready_count != thread_count) {
+    }
+    const auto start = std::chrono::steady_clock::now();
+    start_flag.store(true, std::memory_order_release);
+    if (is_activated)
+        pauseOverthrower(0);
+    for (auto& thread : threads)
+        thread.join();
+    const auto finish = std::chrono::steady_clock::now();
+    if (is_activated)
+        resumeOverthrower();
+
+    const unsigned int leaked = is_activated ? deactivateOverthrower() : 0U;
+    applyScenario(Scenario{ nullptr, nullptr, { nullptr }, false, 1U });
+
+    Result total{};
+    for (const Result& result : results) {
+        total.operations += result.operations;
+        total.failures += result.failures;
+    }
+
+    const double elapsed_ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(finish - start).count());
+    const double ns_per_op = elapsed_ns / iterations;
+    const double ops_per_second = elapsed_ns > 0 ? static_cast<double>(total.operations) * 1e9 / elapsed_ns : 0.0;
+
+    fprintf(stderr, "%-16s %-16s %3u threads: %10.1f ns/op %14.0f op/s\n", scenario.name, g_operation_names[operation], thread_count, ns_per_op, ops_per_second);
+    printf("%s\n    {\"label\": \"%s\", \"scenario\": \"%s\", \"operation\": \"%s\", \"threads\": %u, \"iterations\": %u, "
+           "\"ns_per_op\": %.2f, \"ops_per_second\": %.0f, \"failures\": %llu, \"leaked_blocks\": %u}",
+           is_first_result ? "" : ",",
+           label.c_str(),
+           scenario.name,
+           g_operation_names[operation],
+           thread_count,
+           iterations,
+           ns_per_op,
+           ops_per_second,
+           total.failures,
+           leaked);
+    is_first_result = false;
+}
+
+// Labels are printed into JSON strings, so quotes, backslashes and control characters are escaped.
+static std::string escapeJson(const char* text)
+{
+    std::string escaped;
+    for (; *text; ++text) {
+        const unsigned char c = static_cast<unsigned char>(*text);
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += static_cast<char>(c);
+        }
+        else if (c < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        }
+        else {
+            escaped += static_cast<char>(c);
+        }
+    }
+    return escaped;
+}
+
+static std::vector<unsigned int> parseThreadCounts(const char* list)
+{
+    std::vector<unsigned int> thread_counts;
+    while (*list) {
+        char* end = nullptr;
+        const unsigned long value = strtoul(list, &end, 10);
+        if (end == list || value == 0 || value > 1024) {
+            fprintf(stderr, "Invalid list of thread counts.\n");
+            exit(EXIT_FAILURE);
+        }
+        thread_counts.push_back(static_cast<unsigned int>(value));
+        list = *end == ',' ? end + 1 : end;
+    }
+    return thread_counts;
+}
+
+int main(int argc, const char** argv)
+{
+    std::string label = "default";
+    std::string scenario_filter;
+    unsigned int iterations = 200000;
+    std::vector<unsigned int> thread_counts{ 1, 2, 4, 8, 16, 32, 64 };
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--label") == 0) {
+            label = escapeJson(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--iterations") == 0) {
+            iterations = static_cast<unsigned int>(strtoul(argv[i + 1], nullptr, 10));
+        }
+        else if (strcmp(argv[i], "--threads") == 0) {
+            thread_counts = parseThreadCounts(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--scenario") == 0) {
+            scenario_filter = argv[i + 1];
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!iterations) {
+        fprintf(stderr, "Count of iterations must be positive.\n");
+        return EXIT_FAILURE;
+    }
+
+    const bool is_injected = activateOverthrower && deactivateOverthrower && pauseOverthrower && resumeOverthrower;
+    if (!is_injected)
+        fprintf(stderr, "Seems like overthrower has not been injected, only the native allocator is measured.\n");
+
+    bool is_first_result = true;
+    printf("{\n  \"overthrower\": %s,\n  \"results\": [", is_injected ? "true" : "false");
+    for (const Scenario& scenario : g_scenarios) {
+        if (!scenario_filter.empty() && scenario_filter != scenario.name)
+            continue;
+        if (!is_injected && scenario.strategy)
+            continue;
+        for (Operation operation : { OPERATION_MALLOC_FREE, OPERATION_REALLOC, OPERATION_FREE_UNTRACKED, OPERATION_NEW_DELETE }) {
+            for (unsigned int thread_count : thread_counts) {
+                const unsigned int scenario_iterations = std::max(1U, iterations / scenario.iteration_divisor);
+                benchmark(scenario, operation, thread_count, scenario_iterations, label, is_first_result);
+            }
+        }
+    }
+    printf("\n  ]\n}\n");
+
+    return EXIT_SUCCESS;
+}
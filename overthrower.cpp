@@ -9,6 +9,8 @@
 #include <cerrno>
 #include <cinttypes>
 #include <climits>
+#include <cmath>
+#include <cstdarg>
 #include <cstddef>
 #include <cstdio>
 #include <cstdlib>
@@ -16,19 +18,40 @@
 
 #include "platform.h"
 
+#define OVERTHROWER_TYPES_ONLY // The header declares all functions as weak, they are defined here.
+#include "overthrower.h"
+
+#if defined(WITH_LIBUNWIND) && defined(WITH_FAST_UNWIND)
+#error "WITH_LIBUNWIND and WITH_FAST_UNWIND are mutually exclusive"
+#endif
+
 #if defined(WITH_LIBUNWIND) // libunwind is basically available on Linux only.
 #define UNW_LOCAL_ONLY
-#include <cxxabi.h> // for __cxa_demangle
 #include <libunwind.h>
+#elif defined(WITH_FAST_UNWIND) // Same as libunwind, this backend is supported on Linux only.
+#include <unwind.h>
 #else
 #include <execinfo.h>
 #endif
-#if defined(PLATFORM_OS_LINUX)
+#include <cxxabi.h> // for __cxa_demangle
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(PLATFORM_OS_LINUX)
+#include <elf.h>
+#include <link.h>
+#include <malloc.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #endif
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 #include <mutex>
-#include <unordered_map>
+#include <new>
+
+#include <pthread.h>
+#include <signal.h>
 
 #if defined(PLATFORM_OS_MAC_OS_X)
 #include "thread_local.h"
@@ -40,46 +63,100 @@
 
 #if defined(PLATFORM_OS_LINUX)
 #define MAX_STACK_DEPTH 7
+#define KNOWLEDGE_BASE_DEPTH 5U
 #elif defined(PLATFORM_OS_MAC_OS_X)
 #define MAX_STACK_DEPTH 5
 #endif
 #define MAX_STACK_DEPTH_VERBOSE 256
-#define MAX_PAUSE_DEPTH 16
+#define MAX_PAUSE_RUNS 16U
 
 typedef void* (*Malloc)(size_t size);
 typedef void* (*Realloc)(void* pointer, size_t size);
 typedef void (*Free)(void* pointer);
+typedef void* (*Calloc)(size_t count, size_t size);
+typedef int (*PosixMemalign)(void** pointer, size_t alignment, size_t size);
+typedef void* (*AlignedAlloc)(size_t alignment, size_t size);
+typedef void* (*Valloc)(size_t size);
 
 #if defined(PLATFORM_OS_LINUX)
-static Malloc native_malloc = nullptr;
-static Realloc native_realloc = nullptr;
-static Free native_free = nullptr;
+typedef size_t (*MallocUsableSize)(void* pointer);
+typedef int (*CxaAtExit)(void (*function)(void*), void* argument, void* dso_handle);
+
+// Native functions initially point to lazy stubs which resolve all native functions and forward the call.
+// Normally native functions are resolved eagerly by the constructor of overthrower, stubs serve calls which happen even earlier
+// (constructors of libraries which are initialized before overthrower), so none of intercepted functions has to check anything.
+static void* lazyMalloc(size_t size) noexcept;
+static void* lazyRealloc(void* pointer, size_t size) noexcept;
+static void lazyFree(void* pointer) noexcept;
+static void* lazyCalloc(size_t count, size_t size) noexcept;
+static int lazyPosixMemalign(void** pointer, size_t alignment, size_t size) noexcept;
+static void* lazyAlignedAlloc(size_t alignment, size_t size) noexcept;
+static void* lazyMemalign(size_t alignment, size_t size) noexcept;
+static void* lazyValloc(size_t size) noexcept;
+static size_t lazyMallocUsableSize(void* pointer) noexcept;
+static int lazyCxaAtExit(void (*function)(void*), void* argument, void* dso_handle) noexcept;
+
+static Malloc native_malloc = lazyMalloc;
+static Realloc native_realloc = lazyRealloc;
+static Free native_free = lazyFree;
+static Calloc native_calloc = lazyCalloc;
+static PosixMemalign native_posix_memalign = lazyPosixMemalign;
+static AlignedAlloc native_aligned_alloc = lazyAlignedAlloc;
+static AlignedAlloc native_memalign = lazyMemalign;
+static Valloc native_valloc = lazyValloc;
+static MallocUsableSize native_malloc_usable_size = lazyMallocUsableSize;
+static CxaAtExit native_cxa_atexit = lazyCxaAtExit;
 #endif
 
 #if defined(PLATFORM_OS_MAC_OS_X)
 #define my_malloc my_malloc
 #define my_free my_free
 #define my_realloc my_realloc
+#define my_calloc my_calloc
+#define my_posix_memalign my_posix_memalign
+#define my_valloc my_valloc
 #define native_malloc malloc
 #define native_free free
 #define native_realloc realloc
+#define native_calloc calloc
+#define native_posix_memalign posix_memalign
+#define native_valloc valloc
 #elif defined(PLATFORM_OS_LINUX)
 #define my_malloc malloc
 #define my_free free
 #define my_realloc realloc
+#define my_calloc calloc
+#define my_posix_memalign posix_memalign
+#define my_aligned_alloc aligned_alloc
+#define my_memalign memalign
+#define my_valloc valloc
+#define my_malloc_usable_size malloc_usable_size
 #define native_malloc native_malloc
 #define native_free native_free
 #define native_realloc native_realloc
+#define native_calloc native_calloc
+#define native_posix_memalign native_posix_memalign
+#define native_aligned_alloc native_aligned_alloc
+#define native_memalign native_memalign
+#define native_valloc native_valloc
+#define native_malloc_usable_size native_malloc_usable_size
 #endif
 
 void* nonFailingMalloc(size_t size) noexcept;
 void nonFailingFree(void* pointer) noexcept;
+void* nonFailingMap(size_t size) noexcept;
+void nonFailingUnmap(void* pointer, size_t size) noexcept;
+static Malloc selectMallocHotPath(unsigned int strategy, unsigned int verbose_mode, bool self_overthrow) noexcept;
+static unsigned int captureStack(uintptr_t* ips, unsigned int max_count) noexcept;
 
 enum {
     STRATEGY_RANDOM = 0U,
     STRATEGY_STEP = 1U,
     STRATEGY_PULSE = 2U,
     STRATEGY_NONE = 3U,
+    STRATEGY_SITE = 4U,
+    STRATEGY_SCHEDULE = 5U,
+    STRATEGY_CALLBACK = 6U, // Installed using setOverthrowerStrategy, can not be chosen using OVERTHROWER_STRATEGY.
 };
 
 #define MIN_DUTY_CYCLE 1
@@ -98,22 +175,168 @@ enum {
     VERBOSE_ALL_ALLOCATIONS = 2U,
 };
 
-static std::array<const char*, 4> g_strategy_names{ "random", "step", "pulse", "none" };
+static std::array<const char*, 7> g_strategy_names{ "random", "step", "pulse", "none", "site", "schedule", "callback" };
+
+enum {
+    SEQUENCE_GLOBAL = 0U,  // Allocations are numbered by a single counter, numbers follow the order of allocations exactly.
+    SEQUENCE_BATCHED = 1U, // Threads reserve ranges of numbers, numbers are unique but neither dense nor ordered across threads.
+    SEQUENCE_THREAD = 2U,  // Every thread numbers its own allocations, step and pulse strategies apply to every thread separately.
+};
+
+#define SEQUENCE_BATCH_SIZE 64U
+
+static std::array<const char*, 3> g_sequence_names{ "global", "batched", "thread" };
+
+enum {
+    FORK_INHERIT = 0U, // A forked child keeps tracking blocks of its parent, they are reported as leaks unless the child frees them.
+    FORK_RESET = 1U,   // A forked child starts with an empty registry and zero statistics, only its own allocations are tracked.
+    FORK_DORMANT = 2U, // Overthrower is dormant in a forked child.
+};
+
+static std::array<const char*, 3> g_fork_policy_names{ "inherit", "reset", "dormant" };
+
+#define MAX_SAMPLE_RATE (1U << 30U) // Mean count of bytes between sampled allocations, 1 GiB at most.
+
+// Globals which are written by allocating threads occupy cache lines of their own,
+// so read-mostly settings (g_activated, g_strategy, g_duty_cycle, ...) are never invalidated by allocations of other threads.
+template<typename T>
+struct alignas(64) CacheLineAtomic : std::atomic<T> {
+    using std::atomic<T>::atomic;
+    using std::atomic<T>::operator=;
+};
 
 static bool g_activated = false;
 static bool g_self_overthrow = false;
 static unsigned int g_verbose_mode = VERBOSE_NO;
+static bool g_leak_sites = false;
+static bool g_reclaim_leaks = false;
+static bool g_deferred_traces = false;
+static bool g_scoped = false;        // Allocation functions check whether a caller is in scope (see isInScope).
+static bool g_thread_scoped = false; // Activated using activateOverthrowerForThisThread.
+static unsigned int g_fork_policy = FORK_INHERIT;
+static bool g_quiet = false;           // OVERTHROWER_QUIET=1: informational messages are not printed, warnings and reports still are.
 static unsigned int g_strategy = STRATEGY_RANDOM;
+static OverthrowerStrategy g_strategy_callback{};
+
+struct RuntimeConfiguration;
+template<typename Configuration>
+static void* mallocHotPath(size_t size) noexcept;
+
+// Specialization of the malloc decision pipeline for the current strategy and modes, installed on activation.
+// Until the first activation it is the generic pipeline, a thread which sees g_activated before the pointer still calls a valid one.
+static Malloc g_malloc_hot_path = mallocHotPath<RuntimeConfiguration>;
 static unsigned int g_seed = 0;
 static unsigned int g_duty_cycle = 1024;
 static unsigned int g_delay = MIN_DELAY;
 static unsigned int g_duration = MIN_DURATION;
-static std::atomic<unsigned int> g_malloc_counter{};
+static unsigned int g_sequence_mode = SEQUENCE_GLOBAL;
+static unsigned int g_sample_rate = 0; // 0 - every allocation is tracked.
+static CacheLineAtomic<unsigned int> g_malloc_counter{};
+// Every activation starts new sequences of pseudo random and sequential numbers, threads pick up new ones lazily.
+static std::atomic<unsigned int> g_random_generation{ 1U };
+static CacheLineAtomic<unsigned int> g_random_thread_ordinal{};
+
+// Prints an informational message to stderr unless overthrower is quiet.
+__attribute__((format(printf, 1, 2))) static void announce(const char* format, ...) noexcept
+{
+    if (g_quiet)
+        return;
+    va_list arguments;
+    va_start(arguments, format);
+    vfprintf(stderr, format, arguments);
+    va_end(arguments);
+}
+
+class ReportWriter;
+struct StatsSlot;
+
+// Nested pauses of a thread. Consecutive levels with equal remaining durations are stored as a single run,
+// only the topmost level is ever consumed, so pushing, popping and consuming are O(1) and nesting depth is virtually unlimited
+// (levels which are paused infinitely or have already been consumed always collapse).
+// Levels which do not fit into MAX_PAUSE_RUNS runs are only counted and paused infinitely, so an overflow never resumes a level too early.
+struct PauseStack {
+    struct Run {
+        unsigned int remaining; // UINT_MAX - infinite.
+        unsigned int count;
+    };
+
+    bool isPaused() const noexcept { return overflow_count || (run_count && runs[run_count - 1U].remaining); }
+
+    void push(unsigned int duration) noexcept
+    {
+        if (overflow_count) {
+            ++overflow_count;
+        }
+        else if (run_count && runs[run_count - 1U].remaining == duration) {
+            ++runs[run_count - 1U].count;
+        }
+        else if (run_count == MAX_PAUSE_RUNS) {
+            overflow_count = 1U;
+        }
+        else {
+            runs[run_count++] = Run{ duration, 1U };
+        }
+    }
+
+    void pop() noexcept
+    {
+        if (overflow_count)
+            --overflow_count;
+        else if (run_count && --runs[run_count - 1U].count == 0)
+            --run_count;
+    }
+
+    // Has to be invoked only when isPaused() is true.
+    void consume() noexcept
+    {
+        if (overflow_count)
+            return;
+        Run& top = runs[run_count - 1U];
+        if (top.remaining == UINT_MAX)
+            return;
+        const unsigned int remaining = top.remaining - 1U;
+        if (top.count == 1U) {
+            if (run_count > 1U && runs[run_count - 2U].remaining == remaining) {
+                ++runs[run_count - 2U].count;
+                --run_count;
+            }
+            else {
+                top.remaining = remaining;
+            }
+        }
+        else if (run_count < MAX_PAUSE_RUNS) {
+            --top.count;
+            runs[run_count++] = Run{ remaining, 1U };
+        }
+        else {
+            // The topmost level can not get a run of its own, it is paused infinitely from now on.
+            --top.count;
+            overflow_count = 1U;
+        }
+    }
+
+    Run runs[MAX_PAUSE_RUNS];
+    unsigned int run_count;
+    unsigned int overflow_count; // Topmost levels which do not fit into runs.
+};
 
 struct State {
     bool is_tracing;
-    unsigned int paused[MAX_PAUSE_DEPTH + 1];
-    unsigned int depth;
+    PauseStack pauses;
+    unsigned int random_generation;
+    uint64_t random_state;
+    unsigned int sequence_generation;
+    unsigned int seq_num; // Next sequential number unless SEQUENCE_GLOBAL is used.
+    unsigned int seq_end; // End of a range reserved by SEQUENCE_BATCHED.
+    unsigned int timing_calls; // Calls of the native allocator since the last timed one.
+    unsigned int sample_generation;
+    uint64_t sample_state;     // State of a generator of sampling intervals, separate from the one of random strategy.
+    size_t sample_bytes_left;  // Bytes to allocate before the next sampled allocation.
+    unsigned int schedule_generation;
+    unsigned int scope_generation; // Equals to g_random_generation if the thread is in scope of activateOverthrowerForThisThread.
+    size_t schedule_cursor; // The first entry of the schedule which may be still ahead of this thread.
+    ReportWriter* trace; // Receives frames of a call stack which is being printed.
+    StatsSlot* stats;    // Claimed on the first allocation after activation, never released.
 };
 
 static thread_local State g_state{};
@@ -121,327 +344,3172 @@ static thread_local State g_state{};
 #if defined(PLATFORM_OS_MAC_OS_X)
 static ThreadLocal<bool> g_initialized;
 static ThreadLocal<bool> g_initializing;
-#elif defined(PLATFORM_OS_LINUX)
-static bool g_initialized = false;
 #endif
 
 struct Info {
     unsigned int seq_num;
+    unsigned int site; // Call site which has allocated the block (see CallSiteCache), 0 if it is not known.
     size_t size;
 };
 
-template<class T>
-class mallocFreeAllocator {
+// Leak reports and call stacks are written to stderr unless OVERTHROWER_REPORT_FILE is given.
+static int g_report_fd = STDERR_FILENO;
+
+// Reports are formatted into a fixed buffer and flushed using write(2) in large chunks.
+// Neither stdio nor malloc is involved, so a writer can be safely used inside allocation functions, and huge reports are cheap.
+#define REPORT_BUFFER_SIZE 4096U
+
+class ReportWriter final {
 public:
-    typedef size_t size_type;
-    typedef T* pointer;
-    typedef T& reference;
-#pragma clang diagnostic push
-#pragma ide diagnostic ignored "OCUnusedGlobalDeclarationInspection"
-    // This is falsely detected as unused.
-    typedef T value_type;
-#pragma clang diagnostic pop
+    ReportWriter() noexcept
+        : ReportWriter(g_report_fd)
+    {
+    }
+
+    explicit ReportWriter(int fd) noexcept
+        : m_fd(fd)
+    {
+    }
+
+    ReportWriter(const ReportWriter&) = delete;
+    ReportWriter& operator=(const ReportWriter&) = delete;
+    ~ReportWriter() { flush(); }
+
+    ReportWriter& text(const char* string) noexcept
+    {
+        while (*string)
+            put(*string++);
+        return *this;
+    }
 
-    mallocFreeAllocator() noexcept = default;
+    // Right aligned within width unless left_aligned is requested, same as "%*llu" and "%-*llu".
+    ReportWriter& decimal(unsigned long long value, unsigned int width = 0, bool left_aligned = false) noexcept
+    {
+        char digits[20];
+        unsigned int count = 0;
+        do {
+            digits[count++] = static_cast<char>('0' + value % 10U);
+            value /= 10U;
+        } while (value);
+        return number(digits, count, width, left_aligned ? ' ' : 0);
+    }
 
-    template<class U>
-    explicit mallocFreeAllocator(const mallocFreeAllocator<U>&) noexcept
+    // Lowercase hexadecimal digits without a prefix, padded with zeroes up to width, same as "%0*llx".
+    ReportWriter& hex(unsigned long long value, unsigned int width = 0) noexcept
     {
+        char digits[16];
+        unsigned int count = 0;
+        do {
+            digits[count++] = "0123456789abcdef"[value % 16U];
+            value /= 16U;
+        } while (value);
+        while (count < width && count < sizeof(digits))
+            digits[count++] = '0';
+        return number(digits, count, 0, 0);
     }
 
-    ~mallocFreeAllocator() noexcept = default;
+    // Raw binary data, written exactly as it is laid out in memory.
+    ReportWriter& bytes(const void* data, size_t size) noexcept
+    {
+        const auto begin = static_cast<const char*>(data);
+        for (size_t i = 0; i < size; ++i)
+            put(begin[i]);
+        return *this;
+    }
 
-    pointer allocate(size_type size)
+    void flush() noexcept
     {
-        assert(size > 0);                                                          // Do not expect STL containers to allocate memory blocks having no size.
-        auto temp = reinterpret_cast<pointer>(nonFailingMalloc(size * sizeof(T))); // NOLINT(bugprone-sizeof-expression)
-        if (!temp) {
-            throw std::bad_alloc(); // Real OOM
+        const int old_errno = errno;
+        size_t offset = 0;
+        while (offset < m_size) {
+            const ssize_t written = write(m_fd, m_buffer + offset, m_size - offset);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                break; // Nothing can be done, a report is lost.
+            offset += static_cast<size_t>(written);
         }
-        return temp;
+        m_size = 0;
+        errno = old_errno;
     }
 
-#pragma clang diagnostic push
-#pragma ide diagnostic ignored "OCUnusedGlobalDeclarationInspection"
-    // This is falsely detected as unused.
-    void deallocate(pointer p, size_type) noexcept
+private:
+    void put(char character) noexcept
     {
-        nonFailingFree(p);
+        if (m_size == sizeof(m_buffer))
+            flush();
+        m_buffer[m_size++] = character;
     }
-#pragma clang diagnostic pop
 
-    void construct(pointer p, const T& val)
+    // digits are in reverse order, trailing_fill is used for left aligned numbers.
+    ReportWriter& number(const char* digits, unsigned int count, unsigned int width, char trailing_fill) noexcept
     {
-        new (reinterpret_cast<void*>(p)) T(val);
+        for (unsigned int i = count; !trailing_fill && i < width; ++i)
+            put(' ');
+        for (unsigned int i = count; i > 0; --i)
+            put(digits[i - 1U]);
+        for (unsigned int i = count; trailing_fill && i < width; ++i)
+            put(trailing_fill);
+        return *this;
     }
+
+    int m_fd;
+    char m_buffer[REPORT_BUFFER_SIZE];
+    size_t m_size{};
 };
 
-static std::recursive_mutex g_mutex;                                                                                                           // NOLINT
-static std::unordered_map<void*, Info, std::hash<void*>, std::equal_to<void*>, mallocFreeAllocator<std::pair<void* const, Info>>> g_allocated; // NOLINT
+// Allocation statistics are kept in per-thread slots and aggregated only when queried, so counting never makes threads contend.
+// Slots are never released (counters of exited threads still count), threads beyond STATS_SLOT_COUNT share the last slot.
+// Blocks are often freed by other threads, so live counters of a single slot may go "negative", only their sum makes sense.
+// The peak of live bytes is tracked by publishing changes of live bytes in batches, so it is accurate within a batch per thread.
+#define STATS_SLOT_COUNT 256U
+#define STATS_SIZE_CLASS_COUNT 16U
+#define STATS_LIVE_BYTES_BATCH 65536LL
 
-extern "C" unsigned int deactivateOverthrower() noexcept;
+static_assert(STATS_SIZE_CLASS_COUNT == OVERTHROWER_SIZE_CLASS_COUNT, "Size classes of OverthrowerStats have to match counted ones");
 
-static void initialize() noexcept
-{
-    assert(!g_initialized);
-#if defined(PLATFORM_OS_MAC_OS_X)
-    g_initializing = true;
-    g_state = {};
-    g_initializing = false;
-#elif defined(PLATFORM_OS_LINUX)
-    native_malloc = reinterpret_cast<decltype(native_malloc)>(dlsym(RTLD_NEXT, "malloc"));
-    native_realloc = reinterpret_cast<decltype(native_realloc)>(dlsym(RTLD_NEXT, "realloc"));
-    native_free = reinterpret_cast<decltype(native_free)>(dlsym(RTLD_NEXT, "free"));
-#endif
-    g_initialized = true;
-}
+enum {
+    STAT_ALLOCATIONS,
+    STAT_FAILED,
+    STAT_WHITELISTED,
+    STAT_IGNORED,
+    STAT_PAUSED,
+    STAT_UNSAMPLED,
+    STAT_LIVE_BLOCKS,
+    STAT_LIVE_BYTES,
+    STAT_UNPUBLISHED_LIVE_BYTES,
+    STAT_SIZE_CLASS,
+    STAT_COUNT = STAT_SIZE_CLASS + STATS_SIZE_CLASS_COUNT,
+};
 
-__attribute__((constructor, used)) static void banner() noexcept
+struct TimingHistograms;
+
+// An owner of a slot is the only writer, there is no need for atomic read-modify-write operations unless the slot is shared.
+static void addToCounter(std::atomic<uint64_t>& counter, uint64_t value, bool is_shared) noexcept
 {
-    fprintf(stderr, "overthrower is waiting for the activation signal ...\n");
-    fprintf(stderr, "Invoke activateOverthrower and overthrower will start his job.\n");
+    if (is_shared)
+        counter.fetch_add(value, std::memory_order_relaxed);
+    else
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
 }
 
-__attribute__((destructor, used)) static void shutdown() noexcept
-{
-    if (!g_activated)
-        return;
+struct alignas(64) StatsSlot {
+    void add(unsigned int counter, uint64_t value) noexcept { addToCounter(counters[counter], value, is_shared); }
 
-    fprintf(stderr, "overthrower has not been deactivated explicitly, doing it anyway.\n");
+    std::atomic<uint64_t> counters[STAT_COUNT];
+    std::atomic<TimingHistograms*> timing; // Mapped on the first timed call of the owner (see below).
+    bool is_shared;
+};
 
-    deactivateOverthrower();
-}
+static StatsSlot g_stats_slots[STATS_SLOT_COUNT];
+static CacheLineAtomic<unsigned int> g_stats_slot_count{};
+static CacheLineAtomic<int64_t> g_published_live_bytes{};
+static CacheLineAtomic<int64_t> g_peak_live_bytes{};
 
-static int strToUnsignedLongInt(const char* str, unsigned long int* value) noexcept
+__attribute__((noinline)) static StatsSlot& claimStatsSlot() noexcept
 {
-    char* end_ptr;
-    errno = 0;
-    *value = strtoul(str, &end_ptr, 10);
+    const unsigned int index = g_stats_slot_count.fetch_add(1U, std::memory_order_relaxed);
+    if (index >= STATS_SLOT_COUNT - 1U) {
+        g_stats_slots[STATS_SLOT_COUNT - 1U].is_shared = true;
+        g_state.stats = &g_stats_slots[STATS_SLOT_COUNT - 1U];
+    }
+    else {
+        g_state.stats = &g_stats_slots[index];
+    }
+    return *g_state.stats;
+}
 
-    if (end_ptr[0] != '\0')
-        return -1;
+static StatsSlot& threadStats() noexcept
+{
+    return g_state.stats ? *g_state.stats : claimStatsSlot();
+}
 
-    if ((*value == 0 || *value == ULONG_MAX) && errno == ERANGE)
-        return -1;
+// Class i holds sizes of [2^i; 2^(i+1)) bytes, the first class also includes 0, the last one includes all bigger sizes.
+static unsigned int sizeClass(size_t size) noexcept
+{
+    const unsigned int size_class = size < 2U ? 0U : static_cast<unsigned int>(sizeof(unsigned long long) * CHAR_BIT - 1U - __builtin_clzll(size));
+    return std::min(size_class, STATS_SIZE_CLASS_COUNT - 1U);
+}
 
-    return 0;
+static void countAllocation(size_t size) noexcept
+{
+    StatsSlot& stats = threadStats();
+    stats.add(STAT_ALLOCATIONS, 1U);
+    stats.add(STAT_SIZE_CLASS + sizeClass(size), 1U);
 }
 
-static unsigned int generateRandomValue(const unsigned int min_val, const unsigned int max_val) noexcept
+// blocks is either 1 or -1, bytes is signed accordingly.
+// A block of "size" bytes is sampled with probability 1 - exp(-size / rate), so it stands for 1 / that many allocations on average.
+static double sampleWeight(size_t size) noexcept
 {
-    unsigned int value = (min_val + max_val) / 2;
-    FILE* file = fopen("/dev/urandom", "rb");
-    if (file) {
-        unsigned int tmp_value;
-        // Very unlikely that fread will ever read less than sizeof(int) bytes.
-        // Still be ready to all kinds oddities.
-        if (fread(&tmp_value, 1, sizeof(int), file) == sizeof(int)) {
-            value = tmp_value;
-        }
-        fclose(file);
-    }
-    value = value % (max_val - min_val + (max_val == UINT_MAX ? 0 : 1));
-    value += min_val;
-    return value;
+    if (!g_sample_rate || !size)
+        return 1.0;
+    return -1.0 / std::expm1(-static_cast<double>(size) / g_sample_rate);
 }
 
-static unsigned int readValFromEnvVar(const char* env_var_name,
-                                      unsigned int min_val,
-                                      unsigned int max_val,
-                                      unsigned int max_random_val = 0,
-                                      unsigned int default_value = UINT_MAX) noexcept
+// "direction" is 1 for a block which becomes tracked and -1 for a block which is not tracked anymore.
+// Counters of live blocks are estimates of the whole heap when allocations are sampled.
+static void countLiveBlock(int64_t direction, size_t size) noexcept
 {
-    const char* env_var_val = getenv(env_var_name);
-    unsigned long int value;
+    const double weight = sampleWeight(size);
+    const int64_t blocks = direction * std::llround(weight);
+    const int64_t bytes = direction * std::llround(weight * static_cast<double>(size));
 
-    if (default_value != UINT_MAX) {
-        if (!env_var_val) {
-            return default_value;
-        }
-        if (strToUnsignedLongInt(env_var_val, &value) || value < min_val || value > max_val) {
-            fprintf(stderr, "%s has incorrect value (%s). Using a default value (%u).\n", env_var_name, env_var_val, default_value);
-            return default_value;
-        }
-        return static_cast<unsigned int>(value);
-    }
+    StatsSlot& stats = threadStats();
+    stats.add(STAT_LIVE_BLOCKS, static_cast<uint64_t>(blocks));
+    stats.add(STAT_LIVE_BYTES, static_cast<uint64_t>(bytes));
+    stats.add(STAT_UNPUBLISHED_LIVE_BYTES, static_cast<uint64_t>(bytes));
 
-    if (!env_var_val) {
-        const unsigned int random_value = generateRandomValue(min_val, max_random_val ? max_random_val : max_val);
-        fprintf(stderr, "%s environment variable not set. Using a random value (%u).\n", env_var_name, random_value);
-        return random_value;
-    }
-    else if (strToUnsignedLongInt(env_var_val, &value) || value < min_val || value > max_val) {
-        const unsigned int random_value = generateRandomValue(min_val, max_random_val ? max_random_val : max_val);
-        fprintf(stderr, "%s has incorrect value (%s). Using a random value (%u).\n", env_var_name, env_var_val, random_value);
-        return random_value;
-    }
+    const auto unpublished = static_cast<int64_t>(stats.counters[STAT_UNPUBLISHED_LIVE_BYTES].load(std::memory_order_relaxed));
+    if (unpublished < STATS_LIVE_BYTES_BATCH && unpublished > -STATS_LIVE_BYTES_BATCH)
+        return;
 
-    return static_cast<unsigned int>(value);
+    stats.add(STAT_UNPUBLISHED_LIVE_BYTES, static_cast<uint64_t>(-unpublished));
+    const int64_t live_bytes = g_published_live_bytes.fetch_add(unpublished, std::memory_order_relaxed) + unpublished;
+    int64_t peak = g_peak_live_bytes.load(std::memory_order_relaxed);
+    while (live_bytes > peak && !g_peak_live_bytes.compare_exchange_weak(peak, live_bytes, std::memory_order_relaxed)) {
+    }
 }
 
-extern "C" __attribute__((visibility("default"))) void activateOverthrower() noexcept
+static void resetStats() noexcept
 {
-#if defined(PLATFORM_OS_MAC_OS_X)
-    // Mac OS X implementation uses malloc inside printf generation of functions. If malloc fail, printf-like functions may crash.
-    // To prevent crashes we have to force printf to do all his allocations before we activate the overthrower.
-    static const int integer_number = 22708089;
-    static const double floating_point_number = 22708089.862725008;
-    char tmp_buf[1024];
-    for (int i = 0; i < 1000; ++i)
-        sprintf(tmp_buf, "%d%f\n", integer_number * i * i, floating_point_number * i * i);
-    printf("overthrower have to print useless string to force printf to do all preallocations: %s", tmp_buf);
-#endif
+    for (StatsSlot& slot : g_stats_slots) {
+        for (auto& counter : slot.counters)
+            counter.store(0U, std::memory_order_relaxed);
+    }
+    g_published_live_bytes = 0;
+    g_peak_live_bytes = 0;
+}
 
-    g_malloc_counter = 0;
+// Timing mode (OVERTHROWER_TIMING=N): every N-th call of the native allocator done by a thread is timed using a monotonic clock,
+// durations are collected into log-linear histograms (two buckets per power of two of nanoseconds) per operation and size class.
+// Histograms belong to statistics slots, so they are as contention free as other statistics, and are dumped on deactivation.
+// Failures of the native allocator (real OOM) are counted for every call, not only for timed ones.
+#define TIMING_SIZE_CLASS_COUNT (STATS_SIZE_CLASS_COUNT + 1U) // The last class collects frees of blocks which are not tracked.
+#define TIMING_BUCKET_COUNT 48U                              // The last bucket collects everything which takes 12 ms or more.
+#define TIMING_UNKNOWN_SIZE SIZE_MAX
+#define MAX_TIMING_PERIOD 1000000U
 
-    fprintf(stderr, "overthrower got activation signal.\n");
-    fprintf(stderr, "overthrower will use following parameters for failing allocations:\n");
-    g_strategy = readValFromEnvVar("OVERTHROWER_STRATEGY", STRATEGY_RANDOM, STRATEGY_NONE, STRATEGY_PULSE);
-    fprintf(stderr, "Strategy = %s\n", g_strategy_names[g_strategy]);
-    if (g_strategy == STRATEGY_RANDOM) {
-        g_seed = readValFromEnvVar("OVERTHROWER_SEED", 0, UINT_MAX);
-        g_duty_cycle = readValFromEnvVar("OVERTHROWER_DUTY_CYCLE", MIN_DUTY_CYCLE, MAX_DUTY_CYCLE);
-        srand(g_seed);
-        fprintf(stderr, "Duty cycle = %u\n", g_duty_cycle);
-        fprintf(stderr, "Seed = %u\n", g_seed);
-    }
-    else if (g_strategy != STRATEGY_NONE) {
-        g_delay = readValFromEnvVar("OVERTHROWER_DELAY", MIN_DELAY, MAX_DELAY, MAX_RANDOM_DELAY);
-        fprintf(stderr, "Delay = %u\n", g_delay);
-        if (g_strategy == STRATEGY_PULSE) {
-            g_duration = readValFromEnvVar("OVERTHROWER_DURATION", MIN_DURATION, MAX_DURATION);
-            fprintf(stderr, "Duration = %u\n", g_duration);
-        }
-    }
+enum {
+    TIMING_ALLOCATE, // Allocating functions of the native allocator (malloc, calloc, posix_memalign, ..., realloc).
+    TIMING_FREE,
+    TIMING_OPERATION_COUNT,
+};
 
-    g_self_overthrow = getenv("OVERTHROWER_SELF_OVERTHROW") != nullptr;
-    fprintf(stderr, "Self overthrow mode = %s\n", g_self_overthrow ? "enabled" : "disabled");
+static const char* const g_timing_operation_names[TIMING_OPERATION_COUNT] = { "allocate", "free" };
 
-    g_verbose_mode = readValFromEnvVar("OVERTHROWER_VERBOSE", VERBOSE_NO, VERBOSE_ALL_ALLOCATIONS, 0U, VERBOSE_NO);
-    fprintf(stderr, "Verbose mode = %u\n", g_verbose_mode);
+struct TimingHistograms {
+    std::atomic<uint64_t> buckets[TIMING_OPERATION_COUNT][TIMING_SIZE_CLASS_COUNT][TIMING_BUCKET_COUNT];
+    std::atomic<uint64_t> failures[TIMING_SIZE_CLASS_COUNT];
+};
 
-    g_activated = true;
-}
+static unsigned int g_timing_period = 0; // 0 - timing mode is disabled.
 
-extern "C" __attribute__((visibility("default"))) unsigned int deactivateOverthrower() noexcept
+static uint64_t monotonicNanoseconds() noexcept
 {
-    g_self_overthrow = false;
-    g_activated = false;
-    g_state = {};
-
-    fprintf(stderr, "overthrower got deactivation signal.\n");
-    fprintf(stderr, "overthrower will not fail allocations anymore.\n");
+    timespec now{};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000ULL + static_cast<uint64_t>(now.tv_nsec);
+}
 
-    if (g_allocated.empty())
-        return 0;
+// Buckets 0..3 are exact, bucket 2 * e + h (e >= 2) holds [2^e; 2^e + 2^(e-1)) if h is 0 and [2^e + 2^(e-1); 2^(e+1)) otherwise.
+static unsigned int timingBucket(uint64_t nanoseconds) noexcept
+{
+    if (nanoseconds < 4U)
+        return static_cast<unsigned int>(nanoseconds);
+    const auto exponent = static_cast<unsigned int>(sizeof(unsigned long long) * CHAR_BIT - 1U - __builtin_clzll(nanoseconds));
+    const auto half = static_cast<unsigned int>((nanoseconds >> (exponent - 1U)) & 1U);
+    return std::min(exponent * 2U + half, TIMING_BUCKET_COUNT - 1U);
+}
 
-    fprintf(stderr, "overthrower has detected not freed memory blocks with following addresses:\n");
-    for (const auto& v : g_allocated)
-        fprintf(stderr, "0x%016" PRIxPTR "  -  %6d  -  %10zd\n", (uintptr_t)v.first, v.second.seq_num, v.second.size);
+// Exclusive upper bound of a bucket.
+static uint64_t timingBucketLimit(unsigned int bucket) noexcept
+{
+    if (bucket < 4U)
+        return bucket + 1U;
+    const unsigned int exponent = bucket / 2U;
+    return (bucket % 2U ? 4ULL : 3ULL) << (exponent - 1U);
+}
 
-    fprintf(stderr, "^^^^^^^^^^^^^^^^^^  |  ^^^^^^  |  ^^^^^^^^^^\n");
-    fprintf(stderr, "      pointer       |  malloc  |  block size\n");
-    fprintf(stderr, "                    |invocation|\n");
-    fprintf(stderr, "                    |  number  |\n");
+__attribute__((noinline)) static TimingHistograms* mapTimingHistograms(StatsSlot& stats) noexcept
+{
+    auto histograms = static_cast<TimingHistograms*>(nonFailingMap(sizeof(TimingHistograms)));
+    if (!histograms)
+        return nullptr; // Real OOM, the sample is lost.
+    TimingHistograms* expected = nullptr;
+    if (!stats.timing.compare_exchange_strong(expected, histograms, std::memory_order_acq_rel)) {
+        nonFailingUnmap(histograms, sizeof(TimingHistograms)); // Another thread which shares the slot has been faster.
+        return expected;
+    }
+    return histograms;
+}
 
-    const auto blocks_leaked = static_cast<unsigned int>(g_allocated.size());
-    g_allocated.clear();
-    return blocks_leaked;
+static TimingHistograms* threadHistograms() noexcept
+{
+    StatsSlot& stats = threadStats();
+    TimingHistograms* histograms = stats.timing.load(std::memory_order_acquire);
+    return histograms ? histograms : mapTimingHistograms(stats);
 }
 
-extern "C" __attribute__((visibility("default"))) void pauseOverthrower(unsigned int duration) noexcept
+// Decides whether the next call of the native allocator is timed.
+static bool isTimingSample() noexcept
 {
+    if (!g_timing_period)
+        return false;
 #if defined(PLATFORM_OS_MAC_OS_X)
-    if (!g_initialized)
-        initialize();
+    if (g_initializing || !g_initialized)
+        return false; // Thread local storage is being set up (or is not set up yet) and must not be touched.
 #endif
+    State& state = g_state;
+    if (state.is_tracing || ++state.timing_calls < g_timing_period)
+        return false;
+    state.timing_calls = 0;
+    return true;
+}
 
-    duration = duration == 0 ? UINT_MAX : duration;
-
-    if (g_state.depth == MAX_PAUSE_DEPTH) {
-        fprintf(stderr, "pause stack overflow detected.\n");
-        g_state.paused[MAX_PAUSE_DEPTH] = duration;
+static void recordTiming(unsigned int operation, size_t size, uint64_t nanoseconds) noexcept
+{
+    TimingHistograms* histograms = threadHistograms();
+    if (!histograms)
         return;
-    }
-
-    g_state.paused[++g_state.depth] = duration;
+    const unsigned int size_class = size == TIMING_UNKNOWN_SIZE ? TIMING_SIZE_CLASS_COUNT - 1U : sizeClass(size);
+    addToCounter(histograms->buckets[operation][size_class][timingBucket(nanoseconds)], 1U, threadStats().is_shared);
 }
 
-extern "C" __attribute__((visibility("default"))) void resumeOverthrower() noexcept
+static void recordNativeFailure(size_t size) noexcept
 {
-    if (g_state.depth == 0) {
-        fprintf(stderr, "pause stack underflow detected.\n");
+    if (!g_timing_period)
         return;
-    }
+    TimingHistograms* histograms = threadHistograms();
+    if (histograms)
+        addToCounter(histograms->failures[sizeClass(size)], 1U, threadStats().is_shared);
+}
 
-    --g_state.depth;
+// Invokes a call of the native allocator, times it if it is picked as a sample.
+template<typename Call>
+__attribute__((always_inline)) static inline auto timeNativeCall(unsigned int operation, size_t size, Call call) noexcept -> decltype(call())
+{
+    if (!isTimingSample())
+        return call();
+    const uint64_t start = monotonicNanoseconds();
+    const auto result = call();
+    recordTiming(operation, size, monotonicNanoseconds() - start);
+    return result;
 }
 
-static bool isTimeToFail(unsigned int malloc_seq_num) noexcept
+static void resetTimingHistograms() noexcept
 {
-    switch (g_strategy) {
-        case STRATEGY_RANDOM:
-            return rand() % g_duty_cycle == 0; // NOLINT
-        case STRATEGY_STEP:
-            return malloc_seq_num >= g_delay;
-        case STRATEGY_PULSE:
-            return malloc_seq_num >= g_delay && malloc_seq_num < g_delay + g_duration;
-        case STRATEGY_NONE:
-        default: // Just to make static code analyzers fully happy.
-            return false;
+    for (StatsSlot& slot : g_stats_slots) {
+        TimingHistograms* histograms = slot.timing.load(std::memory_order_acquire);
+        if (histograms)
+            memset(static_cast<void*>(histograms), 0, sizeof(TimingHistograms));
     }
 }
 
-void* nonFailingMalloc(size_t size) noexcept
+static void reportSizeClass(ReportWriter& writer, unsigned int size_class) noexcept
 {
-    if (g_self_overthrow && (rand() % 2) == 0) { // NOLINT
-        // By doing this we emulate real OOM conditions where native malloc can really return nullptr.
-        // This may happen if tests are run on a system which is running out of resources.
-        return nullptr;
+    if (size_class == TIMING_SIZE_CLASS_COUNT - 1U) {
+        writer.text("untracked blocks");
+        return;
     }
-
-#if defined(PLATFORM_OS_MAC_OS_X)
-    return malloc(size);
-#elif defined(PLATFORM_OS_LINUX)
-    return native_malloc ? native_malloc(size) : malloc(size);
-#endif
+    const unsigned long long begin = size_class ? 1ULL << size_class : 0ULL;
+    writer.text("[").decimal(begin, 6).text("; ");
+    if (size_class == STATS_SIZE_CLASS_COUNT - 1U)
+        writer.text("   inf)");
+    else
+        writer.decimal(1ULL << (size_class + 1U), 6).text(")");
 }
 
-void nonFailingFree(void* pointer) noexcept
+// Percentiles are reported as upper bounds of buckets, so they are accurate within a quarter of an octave.
+static void reportTimingHistograms() noexcept
 {
-    native_free(pointer);
-}
+    static const unsigned int percentiles[] = { 500U, 900U, 990U, 999U }; // Per mille.
 
-// returns is_in_white_list, is_in_ignore_list pair.
-typedef std::pair<bool, bool> (
-    *BacktraceCallback)(unsigned int depth, uintptr_t ip, uintptr_t sp, const char* library_name, const char* func_name, uintptr_t off);
+    ReportWriter writer;
+    writer.text("overthrower has timed every ").decimal(g_timing_period).text(" call(s) of the native allocator:\n");
+    writer.text("operation |        size class |  samples | failures |      p50 |      p90 |      p99 |    p99.9 |      max\n");
+    for (unsigned int operation = 0; operation < TIMING_OPERATION_COUNT; ++operation) {
+        for (unsigned int size_class = 0; size_class < TIMING_SIZE_CLASS_COUNT; ++size_class) {
+            uint64_t buckets[TIMING_BUCKET_COUNT] = {};
+            uint64_t failures = 0;
+            for (StatsSlot& slot : g_stats_slots) {
+                const TimingHistograms* histograms = slot.timing.load(std::memory_order_acquire);
+                if (!histograms)
+                    continue;
+                for (unsigned int bucket = 0; bucket < TIMING_BUCKET_COUNT; ++bucket)
+                    buckets[bucket] += histograms->buckets[operation][size_class][bucket].load(std::memory_order_relaxed);
+                if (operation == TIMING_ALLOCATE)
+                    failures += histograms->failures[size_class].load(std::memory_order_relaxed);
+            }
 
-#if defined(WITH_LIBUNWIND)
-// ip - instruction pointer
-// sp - stack pointer
-static std::pair<bool, bool> printFrameInfo(unsigned int depth,
-                                            uintptr_t ip,
-                                            uintptr_t sp,
-                                            const char* library_name,
-                                            const char* func_name,
-                                            uintptr_t off) noexcept
-{
-    fprintf(stderr, "#%-2u 0x%016" PRIxPTR " sp=0x%016" PRIxPTR " %s - %s + 0x%" PRIxPTR "\n", depth, ip, sp, library_name, func_name, off);
-#else
-static std::pair<bool, bool> printFrameInfo(unsigned int depth, uintptr_t, uintptr_t, const char*, const char* func_name, uintptr_t)
-{
-    // Only function name is known, nothing else.
-    fprintf(stderr, "#%-2u %s\n", depth, func_name);
-#endif
-    return std::make_pair(false, false);
+            uint64_t sample_count = 0;
+            for (uint64_t count : buckets)
+                sample_count += count;
+            if (!sample_count && !failures)
+                continue;
+
+            writer.text(g_timing_operation_names[operation]).text(operation == TIMING_ALLOCATE ? "  | " : "      | ");
+            reportSizeClass(writer, size_class);
+            writer.text(" | ").decimal(sample_count, 8).text(" | ").decimal(failures, 8);
+            unsigned int bucket = 0;
+            uint64_t cumulative = 0;
+            for (unsigned int percentile : percentiles) {
+                while (bucket < TIMING_BUCKET_COUNT - 1U && (cumulative + buckets[bucket]) * 1000U < sample_count * percentile)
+                    cumulative += buckets[bucket++];
+                writer.text(" | ").decimal(timingBucketLimit(bucket), 6).text("ns");
+            }
+            unsigned int max_bucket = TIMING_BUCKET_COUNT - 1U;
+            while (max_bucket && !buckets[max_bucket])
+                --max_bucket;
+            writer.text(" | ").decimal(timingBucketLimit(max_bucket), 6).text("ns\n");
+        }
+    }
+    writer.text("^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^\n");
 }
 
-__attribute__((noinline)) static std::pair<bool, bool> traverseStack(BacktraceCallback callback) noexcept
-{
-#if defined(WITH_LIBUNWIND)
-    unw_cursor_t cursor;
-    unw_context_t context;
-    Dl_info dl_info;
+// Registry of tracked memory blocks.
+// Addresses are spread over independent shards, every shard is an open addressing hash table (linear probing, backward shift deletion)
+// which is protected by its own lock. Threads which allocate and free distinct blocks almost never meet on the same shard.
+// Tables live in anonymous mappings (see nonFailingMap), so bookkeeping never touches the native heap and never enters allocation functions.
+// Tables are never shrunk until the registry is cleared.
+// A counting filter indexed by address answers "is this block definitely not tracked?" without taking any lock,
+// most blocks freed by a typical program were allocated before activation, while paused or are in the ignore list.
+#define REGISTRY_SHARD_COUNT 64U
+#define REGISTRY_MIN_CAPACITY 128U // A table of the minimal capacity fits a single page.
+#define REGISTRY_FILTER_SIZE 65536U
+
+class Registry final {
+public:
+    struct Slot {
+        void* pointer;
+        Info info;
+    };
+
+    bool insert(void* pointer, const Info& info) noexcept
+    {
+        const uintptr_t hash = hashPointer(pointer);
+        Shard& shard = m_shards[hash % REGISTRY_SHARD_COUNT];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        if ((shard.size + 1U) * 4U > shard.capacity * 3U && !grow(shard))
+            return false;
+
+        const size_t mask = shard.capacity - 1U;
+        for (size_t index = (hash / REGISTRY_SHARD_COUNT) & mask;; index = (index + 1U) & mask) {
+            Slot& slot = shard.slots[index];
+            if (!slot.pointer) {
+                slot.pointer = pointer;
+                slot.info = info;
+                ++shard.size;
+                filterCounter(hash).fetch_add(1U, std::memory_order_relaxed);
+                countLiveBlock(1, info.size);
+                return true;
+            }
+            if (slot.pointer == pointer) {
+                // The same address can not be allocated twice, it can happen only if the block was freed bypassing overthrower.
+                // The old block is accounted as freed, weights of sampled blocks depend on their sizes.
+                countLiveBlock(-1, slot.info.size);
+                countLiveBlock(1, info.size);
+                slot.info = info;
+                return true;
+            }
+        }
+    }
+
+    // "size" receives a size of the erased block, it stays untouched if the block is unknown.
+    bool erase(void* pointer, size_t* size = nullptr) noexcept
+    {
+        const uintptr_t hash = hashPointer(pointer);
+        if (!mayContain(hash))
+            return false;
+
+        Shard& shard = m_shards[hash % REGISTRY_SHARD_COUNT];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        const size_t index = locate(shard, pointer, hash);
+        if (index == SIZE_MAX)
+            return false;
+
+        if (size)
+            *size = shard.slots[index].info.size;
+        countLiveBlock(-1, shard.slots[index].info.size);
+        removeAt(shard, index);
+        filterCounter(hash).fetch_sub(1U, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool find(void* pointer, Info& info) noexcept
+    {
+        const uintptr_t hash = hashPointer(pointer);
+        if (!mayContain(hash))
+            return false;
+
+        Shard& shard = m_shards[hash % REGISTRY_SHARD_COUNT];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        const size_t index = locate(shard, pointer, hash);
+        if (index == SIZE_MAX)
+            return false;
+
+        info = shard.slots[index].info;
+        return true;
+    }
+
+    size_t size() noexcept
+    {
+        size_t total = 0;
+        for (Shard& shard : m_shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            total += shard.size;
+        }
+        return total;
+    }
+
+    // Shards are visited one by one, only the shard which is being visited is locked.
+    template<typename Callback>
+    void forEach(Callback callback) noexcept
+    {
+        for (Shard& shard : m_shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            for (size_t i = 0; i < shard.capacity; ++i) {
+                if (shard.slots[i].pointer)
+                    callback(shard.slots[i]);
+            }
+        }
+    }
+
+    // Copies occupied slots of a single shard into buffer, which is grown using nonFailingMap if needed (released using nonFailingUnmap).
+    // The shard is locked only while slots are copied, never while memory is allocated. Returns SIZE_MAX on real OOM.
+    size_t copyShard(unsigned int index, Slot*& buffer, size_t& buffer_capacity) noexcept
+    {
+        Shard& shard = m_shards[index];
+        for (;;) {
+            size_t required = 0;
+            {
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                if (shard.size <= buffer_capacity) {
+                    size_t count = 0;
+                    for (size_t i = 0; i < shard.capacity; ++i) {
+                        if (shard.slots[i].pointer)
+                            buffer[count++] = shard.slots[i];
+                    }
+                    return count;
+                }
+                required = shard.size;
+            }
+
+            // A little headroom, the shard keeps growing while the lock is released.
+            const size_t new_capacity = required + required / 4U + REGISTRY_MIN_CAPACITY;
+            auto new_buffer = static_cast<Slot*>(nonFailingMap(new_capacity * sizeof(Slot)));
+            if (!new_buffer)
+                return SIZE_MAX;
+            nonFailingUnmap(buffer, buffer_capacity * sizeof(Slot));
+            buffer = new_buffer;
+            buffer_capacity = new_capacity;
+        }
+    }
+
+    void clear() noexcept
+    {
+        for (Shard& shard : m_shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            if (shard.slots)
+                nonFailingUnmap(shard.slots, shard.capacity * sizeof(Slot));
+            shard.slots = nullptr;
+            shard.capacity = 0;
+            shard.size = 0;
+        }
+        for (auto& counter : m_filter)
+            counter.store(0U, std::memory_order_relaxed);
+    }
+
+    // Drops all entries of a registry inherited by a forked child, none of inherited entries is visited and no inherited page is written to,
+    // so nothing is copied on write: tables are unmapped and the filter is replaced by fresh zero pages.
+    // Has to be invoked while the only thread of the child holds all locks (see lockAll).
+    void forget() noexcept
+    {
+        for (Shard& shard : m_shards) {
+            if (shard.slots)
+                nonFailingUnmap(shard.slots, shard.capacity * sizeof(Slot));
+            shard.slots = nullptr;
+            shard.capacity = 0;
+            shard.size = 0;
+        }
+        if (mmap(m_filter, sizeof(m_filter), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_FIXED, -1, 0) == MAP_FAILED) {
+            for (auto& counter : m_filter)
+                counter.store(0U, std::memory_order_relaxed);
+        }
+    }
+
+    // Shards are always locked in the same order, a thread never holds more than one lock of the registry otherwise.
+    void lockAll() noexcept
+    {
+        for (Shard& shard : m_shards)
+            shard.mutex.lock();
+    }
+
+    void unlockAll() noexcept
+    {
+        for (Shard& shard : m_shards)
+            shard.mutex.unlock();
+    }
+
+private:
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        Slot* slots{};
+        size_t capacity{};
+        size_t size{};
+    };
+
+    static uintptr_t hashPointer(const void* pointer) noexcept
+    {
+        // splitmix64 finalizer, all bits of a result depend on all bits of an address.
+        uint64_t value = reinterpret_cast<uintptr_t>(pointer);
+        value = (value ^ (value >> 30U)) * 0xBF58476D1CE4E5B9ULL;
+        value = (value ^ (value >> 27U)) * 0x94D049BB133111EBULL;
+        return static_cast<uintptr_t>(value ^ (value >> 31U));
+    }
+
+    static size_t locate(const Shard& shard, const void* pointer, uintptr_t hash) noexcept
+    {
+        if (!shard.capacity)
+            return SIZE_MAX;
+
+        const size_t mask = shard.capacity - 1U;
+        for (size_t index = (hash / REGISTRY_SHARD_COUNT) & mask;; index = (index + 1U) & mask) {
+            const void* current = shard.slots[index].pointer;
+            if (current == pointer)
+                return index;
+            if (!current)
+                return SIZE_MAX;
+        }
+    }
+
+    static void removeAt(Shard& shard, size_t index) noexcept
+    {
+        // Backward shift deletion: move subsequent entries of the same probe sequence into the hole, no tombstones are needed.
+        const size_t mask = shard.capacity - 1U;
+        for (size_t next = (index + 1U) & mask;; next = (next + 1U) & mask) {
+            Slot& slot = shard.slots[next];
+            if (!slot.pointer)
+                break;
+            const size_t home = (hashPointer(slot.pointer) / REGISTRY_SHARD_COUNT) & mask;
+            // Entry can be moved only if its home position does not lie cyclically in (index; next].
+            if (((next - home) & mask) >= ((next - index) & mask)) {
+                shard.slots[index] = slot;
+                index = next;
+            }
+        }
+        shard.slots[index].pointer = nullptr;
+        --shard.size;
+    }
+
+    static bool grow(Shard& shard) noexcept
+    {
+        const size_t new_capacity = shard.capacity ? shard.capacity * 2U : REGISTRY_MIN_CAPACITY;
+        auto new_slots = static_cast<Slot*>(nonFailingMap(new_capacity * sizeof(Slot)));
+        if (!new_slots)
+            return false; // Real OOM
+
+        const size_t new_mask = new_capacity - 1U;
+        for (size_t i = 0; i < shard.capacity; ++i) {
+            const Slot& slot = shard.slots[i];
+            if (!slot.pointer)
+                continue;
+            size_t index = (hashPointer(slot.pointer) / REGISTRY_SHARD_COUNT) & new_mask;
+            while (new_slots[index].pointer)
+                index = (index + 1U) & new_mask;
+            new_slots[index] = slot;
+        }
+
+        nonFailingUnmap(shard.slots, shard.capacity * sizeof(Slot));
+        shard.slots = new_slots;
+        shard.capacity = new_capacity;
+        return true;
+    }
+
+    // The lowest bits of a hash select a shard and a slot, a counter is selected by the highest ones.
+    std::atomic<uint32_t>& filterCounter(uintptr_t hash) noexcept { return m_filter[(hash >> (sizeof(uintptr_t) * CHAR_BIT - 16U)) % REGISTRY_FILTER_SIZE]; }
+
+    // A block which is being freed was registered (if it was) by a code which happens before the release, relaxed loads are enough.
+    bool mayContain(uintptr_t hash) noexcept { return filterCounter(hash).load(std::memory_order_relaxed) != 0; }
+
+    Shard m_shards[REGISTRY_SHARD_COUNT];
+    alignas(4096) std::atomic<uint32_t> m_filter[REGISTRY_FILTER_SIZE]{}; // Pages of its own, see forget.
+};
+
+static Registry g_registry; // NOLINT
+
+// Reallocated blocks which stay valid but are not tracked anymore, since the registry was unable to grow (real OOM).
+// Such blocks are never reported as leaked, so their number is reported on deactivation instead.
+static CacheLineAtomic<uint64_t> g_untracked_blocks{};
+
+// Cache of knowledge base verdicts keyed by raw call chains.
+// Collecting return addresses is cheap, resolving and comparing function names is not.
+// Entries are never removed: a slot is claimed once, filled and then published, readers never take any locks.
+#if defined(PLATFORM_OS_LINUX)
+// Only frames which are checked against the knowledge base are the part of a key, overthrower's own frames are dropped.
+#define CALL_SITE_DEPTH KNOWLEDGE_BASE_DEPTH
+#define CALL_SITE_CAPTURE_DEPTH (KNOWLEDGE_BASE_DEPTH + 8U)
+#elif defined(PLATFORM_OS_MAC_OS_X)
+#define CALL_SITE_DEPTH (MAX_STACK_DEPTH + 1U)
+#define CALL_SITE_CAPTURE_DEPTH CALL_SITE_DEPTH
+#endif
+#define CALL_SITE_CACHE_SIZE 8192U
+#define CALL_SITE_CACHE_MAX_PROBES 16U
+
+class CallSiteCache final {
+public:
+    // Call sites are identified by positions of their entries, an identifier stays valid until the cache is invalidated.
+    // Both lookup and store return an identifier of a call site or 0 if the call site is not cached.
+    unsigned int lookup(const uintptr_t* ips, unsigned int count, bool& is_in_white_list, bool& is_in_ignore_list) noexcept
+    {
+        const uintptr_t hash = hashCallChain(ips, count);
+        const unsigned int generation = m_generation.load(std::memory_order_acquire);
+        for (unsigned int i = 0; i < CALL_SITE_CACHE_MAX_PROBES; ++i) {
+            const unsigned int index = (hash + i) % CALL_SITE_CACHE_SIZE;
+            const Entry& entry = m_entries[index];
+            const unsigned int state = entry.state.load(std::memory_order_acquire);
+            if (state == ENTRY_EMPTY)
+                break;
+            if (state == ENTRY_READY && entry.generation == generation && entry.hash == hash && entry.count == count &&
+                memcmp(entry.ips, ips, count * sizeof(uintptr_t)) == 0) {
+                is_in_white_list = entry.is_in_white_list;
+                is_in_ignore_list = entry.is_in_ignore_list;
+                m_hits.fetch_add(1U, std::memory_order_relaxed);
+                return index + 1U;
+            }
+        }
+        m_misses.fetch_add(1U, std::memory_order_relaxed);
+        return 0;
+    }
+
+    unsigned int store(const uintptr_t* ips, unsigned int count, bool is_in_white_list, bool is_in_ignore_list) noexcept
+    {
+        const uintptr_t hash = hashCallChain(ips, count);
+        const unsigned int generation = m_generation.load(std::memory_order_acquire);
+        for (unsigned int i = 0; i < CALL_SITE_CACHE_MAX_PROBES; ++i) {
+            const unsigned int index = (hash + i) % CALL_SITE_CACHE_SIZE;
+            Entry& entry = m_entries[index];
+            unsigned int state = ENTRY_EMPTY;
+            if (!entry.state.compare_exchange_strong(state, ENTRY_BUSY, std::memory_order_acquire)) {
+                // Entries which belong to an older generation are reclaimed.
+                if (state != ENTRY_READY || entry.generation == generation ||
+                    !entry.state.compare_exchange_strong(state, ENTRY_BUSY, std::memory_order_acquire))
+                    continue;
+            }
+            entry.generation = generation;
+            entry.hash = hash;
+            entry.count = count;
+            memcpy(entry.ips, ips, count * sizeof(uintptr_t));
+            entry.is_in_white_list = is_in_white_list;
+            entry.is_in_ignore_list = is_in_ignore_list;
+            entry.state.store(ENTRY_READY, std::memory_order_release);
+            return index + 1U;
+        }
+        // The neighbourhood is full, the verdict for this call chain will be computed every time.
+        return 0;
+    }
+
+    // Copies return addresses of a call site into ips (at least CALL_SITE_DEPTH elements), returns count of copied addresses.
+    unsigned int callChain(unsigned int site, uintptr_t* ips) const noexcept
+    {
+        if (!site || site > CALL_SITE_CACHE_SIZE)
+            return 0;
+        const Entry& entry = m_entries[site - 1U];
+        if (entry.state.load(std::memory_order_acquire) != ENTRY_READY)
+            return 0;
+        memcpy(ips, entry.ips, entry.count * sizeof(uintptr_t));
+        return entry.count;
+    }
+
+    // Makes all cached verdicts obsolete and identifiers of call sites reusable, so it is invoked on activation only.
+    void invalidate() noexcept { m_generation.fetch_add(1U, std::memory_order_acq_rel); }
+
+    void resetStatistics() noexcept
+    {
+        m_hits = 0;
+        m_misses = 0;
+    }
+
+    unsigned long long hits() const noexcept { return m_hits; }
+    unsigned long long misses() const noexcept { return m_misses; }
+
+private:
+    enum {
+        ENTRY_EMPTY = 0U,
+        ENTRY_BUSY = 1U,
+        ENTRY_READY = 2U,
+    };
+
+    struct Entry {
+        std::atomic<unsigned int> state;
+        unsigned int generation;
+        unsigned int count;
+        uintptr_t hash;
+        uintptr_t ips[CALL_SITE_DEPTH];
+        bool is_in_white_list;
+        bool is_in_ignore_list;
+    };
+
+    static uintptr_t hashCallChain(const uintptr_t* ips, unsigned int count) noexcept
+    {
+        // FNV-1a over return addresses.
+        uint64_t hash = 0xCBF29CE484222325ULL;
+        for (unsigned int i = 0; i < count; ++i) {
+            hash ^= ips[i];
+            hash *= 0x100000001B3ULL;
+        }
+        return static_cast<uintptr_t>(hash ^ (hash >> 32U));
+    }
+
+    Entry m_entries[CALL_SITE_CACHE_SIZE]{};
+    std::atomic<unsigned int> m_generation{};
+    alignas(64) std::atomic<unsigned long long> m_hits{};
+    alignas(64) std::atomic<unsigned long long> m_misses{};
+};
+
+static CallSiteCache g_call_site_cache; // NOLINT
+
+// Site strategy: the first allocation from every call site fails, all further ones succeed.
+// Call sites are identified across runs by hashes of return addresses relative to bases of loaded objects, so ASLR does not matter.
+// Hashes of exercised call sites are appended to OVERTHROWER_SITES_FILE immediately, a run which has crashed is continued by the next one.
+#define SITE_STATE_UNKNOWN 0U
+#define SITE_STATE_CLAIMED 1U
+#define SITE_STATE_EXERCISED 2U
+
+static std::atomic<unsigned char> g_site_states[CALL_SITE_CACHE_SIZE + 1U];
+static uint64_t* g_exercised_sites = nullptr; // Sorted hashes of call sites exercised by previous runs.
+static size_t g_exercised_site_count = 0;
+static int g_sites_fd = -1;
+
+static uint64_t hashSiteName(const char* name, uint64_t hash) noexcept
+{
+    // Only a file name of an object is taken into account, objects may be loaded from different directories.
+    const char* slash = strrchr(name, '/');
+    for (const char* character = slash ? slash + 1 : name; *character; ++character) {
+        hash ^= static_cast<unsigned char>(*character);
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static uint64_t stableSiteHash(unsigned int site) noexcept
+{
+    uintptr_t ips[CALL_SITE_CAPTURE_DEPTH];
+    const unsigned int count = g_call_site_cache.callChain(site, ips);
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (unsigned int i = 0; i < count; ++i) {
+        Dl_info dl_info;
+        uintptr_t offset = ips[i];
+        if (dladdr(reinterpret_cast<void*>(ips[i]), &dl_info) && dl_info.dli_fname) {
+            hash = hashSiteName(dl_info.dli_fname, hash);
+            offset -= reinterpret_cast<uintptr_t>(dl_info.dli_fbase);
+        }
+        hash ^= offset;
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static void loadExercisedSites() noexcept
+{
+    nonFailingFree(g_exercised_sites);
+    g_exercised_sites = nullptr;
+    g_exercised_site_count = 0;
+
+    for (auto& state : g_site_states)
+        state.store(SITE_STATE_UNKNOWN, std::memory_order_relaxed);
+    // Site 0 is assigned to allocations which call sites are not known, they are never failed.
+    g_site_states[0].store(SITE_STATE_EXERCISED, std::memory_order_relaxed);
+
+    const char* path = getenv("OVERTHROWER_SITES_FILE");
+    if (!path || !*path)
+        return;
+
+    g_sites_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    struct stat file_stat;
+    if (g_sites_fd < 0 || fstat(g_sites_fd, &file_stat) != 0) {
+        fprintf(stderr, "OVERTHROWER_SITES_FILE (%s) can not be opened. Exercised call sites are not saved.\n", path);
+        return;
+    }
+
+    const auto file_size = static_cast<size_t>(file_stat.st_size);
+    auto content = static_cast<char*>(nonFailingMalloc(file_size + 1U));
+    // Every line holds 16 hexadecimal digits and a line feed.
+    g_exercised_sites = static_cast<uint64_t*>(nonFailingMalloc((file_size / 17U + 1U) * sizeof(uint64_t)));
+    if (!content || !g_exercised_sites) {
+        fprintf(stderr, "overthrower is unable to load exercised call sites (out of memory).\n");
+        nonFailingFree(content);
+        return;
+    }
+
+    size_t size = 0;
+    ssize_t bytes_read;
+    while (size < file_size && (bytes_read = pread(g_sites_fd, content + size, file_size - size, static_cast<off_t>(size))) != 0) {
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read < 0)
+            break;
+        size += static_cast<size_t>(bytes_read);
+    }
+    content[size] = '\0';
+
+    for (char* line = content; *line;) {
+        char* end = nullptr;
+        const unsigned long long hash = strtoull(line, &end, 16);
+        if (end == line)
+            break;
+        if (g_exercised_site_count <= file_size / 17U)
+            g_exercised_sites[g_exercised_site_count++] = hash;
+        line = end;
+        while (*line == '\n' || *line == '\r')
+            ++line;
+    }
+    nonFailingFree(content);
+
+    std::sort(g_exercised_sites, g_exercised_sites + g_exercised_site_count);
+    announce("Exercised call sites = %zu\n", g_exercised_site_count);
+}
+
+static void closeExercisedSites() noexcept
+{
+    if (g_sites_fd >= 0) {
+        close(g_sites_fd);
+        g_sites_fd = -1;
+    }
+}
+
+// Invoked only once the state of a call site says it has not been exercised yet.
+__attribute__((noinline)) static bool isFirstAllocationFromSite(unsigned int site) noexcept
+{
+    unsigned char expected = SITE_STATE_UNKNOWN;
+    if (!g_site_states[site].compare_exchange_strong(expected, SITE_STATE_CLAIMED, std::memory_order_acq_rel))
+        return false; // Another thread is failing the first allocation from this call site right now.
+
+    g_state.is_tracing = true;
+    const uint64_t hash = stableSiteHash(site);
+    const bool is_exercised = std::binary_search(g_exercised_sites, g_exercised_sites + g_exercised_site_count, hash);
+    if (!is_exercised && g_sites_fd >= 0) {
+        ReportWriter writer(g_sites_fd);
+        writer.hex(hash, 16).text("\n");
+    }
+    g_state.is_tracing = false;
+
+    g_site_states[site].store(SITE_STATE_EXERCISED, std::memory_order_release);
+    return !is_exercised;
+}
+
+// Schedule strategy: exactly the allocations which sequential numbers are listed in OVERTHROWER_SCHEDULE fail.
+// The file holds a decimal number per line, random strategy writes failures it has produced in the same format to
+// OVERTHROWER_SCHEDULE_RECORD, so a run can be replayed. Replay is exact only when allocations are numbered globally:
+// with per-thread or batched numbering (OVERTHROWER_SEQUENCE) a number does not identify the same allocation in another run.
+// Every thread walks the sorted schedule with a cursor of its own, sequential numbers a thread gets only grow
+// (whatever OVERTHROWER_SEQUENCE is), so an allocation costs a single comparison unless it passes an entry.
+static unsigned int* g_schedule = nullptr; // Sorted, without duplicates.
+static size_t g_schedule_count = 0;
+static size_t g_schedule_capacity = 0;
+static int g_schedule_fd = -1; // Failures of random strategy are recorded here (OVERTHROWER_SCHEDULE_RECORD).
+
+static void loadSchedule() noexcept
+{
+    // Threads which are still running an allocation of the previous activation may read the old schedule, it is released only here.
+    if (g_schedule)
+        nonFailingUnmap(g_schedule, g_schedule_capacity * sizeof(unsigned int));
+    g_schedule = nullptr;
+    g_schedule_count = 0;
+    g_schedule_capacity = 0;
+
+    const char* path = getenv("OVERTHROWER_SCHEDULE");
+    const int fd = path && *path ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        fprintf(stderr, "OVERTHROWER_SCHEDULE (%s) can not be opened. No allocation is failed.\n", path ? path : "not set");
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    const auto file_size = static_cast<size_t>(file_stat.st_size);
+    const void* content = file_size ? mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    // Every entry takes at least 2 bytes: a digit and a line feed.
+    const size_t capacity = file_size / 2U + 1U;
+    g_schedule = content != MAP_FAILED ? static_cast<unsigned int*>(nonFailingMap(capacity * sizeof(unsigned int))) : nullptr;
+    if (!g_schedule) {
+        if (content != MAP_FAILED)
+            munmap(const_cast<void*>(content), file_size);
+        fprintf(stderr, "OVERTHROWER_SCHEDULE (%s) is empty or can not be loaded. No allocation is failed.\n", path);
+        return;
+    }
+    g_schedule_capacity = capacity;
+
+    const char* text = static_cast<const char*>(content);
+    for (size_t i = 0; i < file_size;) {
+        if (text[i] < '0' || text[i] > '9') {
+            ++i;
+            continue;
+        }
+        unsigned long long value = 0;
+        for (; i < file_size && text[i] >= '0' && text[i] <= '9'; ++i)
+            value = std::min(value * 10U + static_cast<unsigned int>(text[i] - '0'), static_cast<unsigned long long>(UINT_MAX));
+        if (g_schedule_count < capacity)
+            g_schedule[g_schedule_count++] = static_cast<unsigned int>(value);
+    }
+    munmap(const_cast<void*>(content), file_size);
+
+    std::sort(g_schedule, g_schedule + g_schedule_count);
+    g_schedule_count = static_cast<size_t>(std::unique(g_schedule, g_schedule + g_schedule_count) - g_schedule);
+    announce("Schedule = %zu allocation(s)\n", g_schedule_count);
+}
+
+__attribute__((always_inline)) static inline bool isScheduledAllocation(unsigned int malloc_seq_num) noexcept
+{
+    State& state = g_state;
+    const unsigned int generation = g_random_generation.load(std::memory_order_relaxed);
+    if (state.schedule_generation != generation) {
+        state.schedule_generation = generation;
+        state.schedule_cursor = 0;
+    }
+
+    size_t cursor = state.schedule_cursor;
+    for (; cursor < g_schedule_count && g_schedule[cursor] < malloc_seq_num; ++cursor) {
+    }
+    state.schedule_cursor = cursor;
+    return cursor < g_schedule_count && g_schedule[cursor] == malloc_seq_num;
+}
+
+// A separate variable, so a schedule which is being replayed is never overwritten by a run which happens to use random strategy.
+static void openScheduleRecord() noexcept
+{
+    const char* path = getenv("OVERTHROWER_SCHEDULE_RECORD");
+    if (!path || !*path)
+        return;
+    g_schedule_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (g_schedule_fd < 0) {
+        fprintf(stderr, "OVERTHROWER_SCHEDULE_RECORD (%s) can not be opened. Failures are not recorded.\n", path);
+        return;
+    }
+    announce("Failures are recorded to %s\n", path);
+    // Lines do not tell which thread has failed an allocation, while every thread replays every line.
+    if (g_sequence_mode == SEQUENCE_THREAD)
+        fprintf(stderr, "Recorded failures are not replayed exactly unless allocations are numbered globally (OVERTHROWER_SEQUENCE).\n");
+}
+
+// Lines are appended by a single write each, so lines of different threads never interleave (but may be out of order).
+__attribute__((noinline)) static void recordScheduledFailure(unsigned int malloc_seq_num) noexcept
+{
+    ReportWriter writer(g_schedule_fd);
+    writer.decimal(malloc_seq_num).text("\n");
+}
+
+static void closeScheduleRecord() noexcept
+{
+    if (g_schedule_fd >= 0) {
+        close(g_schedule_fd);
+        g_schedule_fd = -1;
+    }
+}
+
+#if defined(PLATFORM_OS_LINUX)
+// Knowledge base: address ranges of functions which allocations need special treatment.
+// Ranges are resolved on activation using symbol tables of all loaded objects (both .dynsym and .symtab if it is not stripped),
+// so checking a frame is nothing but a binary search of its return address. Ranges are resolved again whenever a frame
+// does not belong to any known object and objects have been loaded since (e.g. using dlopen after activation).
+// Depths are counted from the first frame which does not belong to overthrower, 0 is the function which invoked an allocation function.
+#define KNOWLEDGE_BASE_CAPACITY 256U
+#define MAX_USER_RULE_COUNT 64U
+#define MAX_USER_RULES_LENGTH 4096U
+#define MAX_OBJECT_RANGE_COUNT 1024U
+#define UNKNOWN_CODE_CACHE_SIZE 256U // Has to be a power of two.
+
+// Pages of code which does not belong to any loaded object (e.g. generated at run time) or does not fit into a table of ranges.
+// Once such a page is seen, frames from it do not make loaded objects scanned again, so it never costs the loader lock on every allocation.
+// A new object can not be loaded into a page which is in use, so the cache only has to be forgotten once objects have been rescanned.
+class UnknownCodeCache {
+public:
+    bool contains(uintptr_t ip) const noexcept
+    {
+        const uintptr_t page = pageOf(ip);
+        return m_pages[slotOf(page)].load(std::memory_order_relaxed) == page;
+    }
+
+    void insert(uintptr_t ip) noexcept
+    {
+        const uintptr_t page = pageOf(ip);
+        m_pages[slotOf(page)].store(page, std::memory_order_relaxed);
+    }
+
+    void clear() noexcept
+    {
+        for (auto& page : m_pages)
+            page.store(0U, std::memory_order_relaxed);
+    }
+
+private:
+    // A return address may point right past the end of a function which never returns, ip - 1 is always inside the caller.
+    // Page numbers are offset by one, so an empty slot never matches.
+    static uintptr_t pageOf(uintptr_t ip) noexcept { return ((ip - 1U) >> 12U) + 1U; }
+    static unsigned int slotOf(uintptr_t page) noexcept
+    {
+        return static_cast<unsigned int>((static_cast<uint64_t>(page) * 0x9E3779B97F4A7C15ULL) >> 32U) & (UNKNOWN_CODE_CACHE_SIZE - 1U);
+    }
+
+    std::atomic<uintptr_t> m_pages[UNKNOWN_CODE_CACHE_SIZE]{};
+};
+
+struct KnowledgeBaseRule {
+    const char* name;
+    unsigned int min_depth;
+    unsigned int max_depth;
+    bool is_in_white_list;
+    bool is_in_ignore_list;
+};
+
+static const KnowledgeBaseRule g_builtin_rules[] = {
+    { "__cxa_allocate_exception", 0U, 1U, true, false },
+    // These two functions tend to leak, especially in OOM conditions.
+    // https://sourceware.org/bugzilla/show_bug.cgi?id=2451
+    // https://sourceware.org/legacy-ml/libc-alpha/2013-09/msg00150.html
+    { "_dl_map_object", 0U, KNOWLEDGE_BASE_DEPTH - 1U, false, true },
+    { "_dl_map_object_deps", 0U, KNOWLEDGE_BASE_DEPTH - 1U, false, true },
+    { "_dl_catch_exception", 1U, 2U, false, true },
+    { "_dl_signal_error", 0U, 0U, true, true },
+    { "_dl_exception_create", 0U, 0U, true, true },
+    { "dlerror", 1U, 2U, false, true },
+    // Since glibc 2.34 dlopen keeps a description of the last error in a block which is freed only when a thread exits.
+    { "dlopen", 1U, 1U, false, true },
+    // Dynamic thread vector (calloc) lives as long as a cached stack of a thread, not as long as the thread itself.
+    // A failure of this allocation is reported by pthread_create as EAGAIN which is not an OOM condition for its callers.
+    { "_dl_allocate_tls", 0U, 1U, true, true },
+    { "_dl_allocate_tls_init", 0U, 1U, true, true },
+    // https://patches-gcc.linaro.org/patch/6525/
+    { "__libpthread_freeres", 0U, KNOWLEDGE_BASE_DEPTH - 1U, false, true },
+};
+
+class KnowledgeBase final {
+public:
+    // Does nothing if neither the set of loaded objects nor user defined rules have changed since the previous invocation.
+    // Returns true if the knowledge base has been rebuilt.
+    bool build() noexcept
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const bool white_list_changed = readUserRules("OVERTHROWER_WHITELIST", m_white_list);
+        const bool ignore_list_changed = readUserRules("OVERTHROWER_IGNORE_LIST", m_ignore_list);
+        return rebuild(!m_built || white_list_changed || ignore_list_changed);
+    }
+
+    // Rebuilds the knowledge base if some of frames does not belong to any known object and objects have been loaded since it has been built.
+    // User defined rules stay the same. Verdicts which are already cached are kept until the next activation, so identifiers of
+    // call sites stay valid for the whole activation, only call chains which are not cached yet are checked against new tables.
+    void refresh(const uintptr_t* ips, unsigned int count) noexcept
+    {
+        const Table& table = m_tables[m_current.load(std::memory_order_acquire)];
+        unsigned int depth = 0;
+        while (depth < count && (isKnownCode(table, ips[depth]) || m_unknown_code.contains(ips[depth])))
+            ++depth;
+        if (depth == count)
+            return;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        rebuild(false);
+        const Table& current = m_tables[m_current.load(std::memory_order_relaxed)];
+        for (; depth < count; ++depth) {
+            if (!isKnownCode(current, ips[depth]))
+                m_unknown_code.insert(ips[depth]);
+        }
+    }
+
+    bool isOwnFrame(uintptr_t ip) const noexcept { return ip - 1U >= m_own_begin && ip - 1U < m_own_end; }
+
+    void lock() noexcept { m_mutex.lock(); }
+    void unlock() noexcept { m_mutex.unlock(); }
+
+    // ips are return addresses, ips[0] belongs to the function which invoked an allocation function.
+    std::pair<bool, bool> check(const uintptr_t* ips, unsigned int count) const noexcept
+    {
+        const Table& table = m_tables[m_current.load(std::memory_order_acquire)];
+
+        for (unsigned int depth = 0; depth < count; ++depth) {
+            // A return address may point right past the end of a function which never returns, ip - 1 is always inside the caller.
+            const uintptr_t ip = ips[depth] - 1U;
+            const Entry* upper = std::upper_bound(table.entries, table.entries + table.count, ip, [](uintptr_t value, const Entry& entry) {
+                return value < entry.begin;
+            });
+            // Several rules may refer to the same function, all of them start at the same address.
+            for (const Entry* entry = upper; entry != table.entries && (entry - 1)->begin == (upper - 1)->begin; --entry) {
+                const Entry& candidate = *(entry - 1);
+                if (ip < candidate.end && depth >= candidate.min_depth && depth <= candidate.max_depth)
+                    return std::make_pair(candidate.is_in_white_list, candidate.is_in_ignore_list);
+            }
+        }
+
+        return std::make_pair(false, false);
+    }
+
+private:
+    struct Entry {
+        uintptr_t begin;
+        uintptr_t end;
+        unsigned int min_depth;
+        unsigned int max_depth;
+        bool is_in_white_list;
+        bool is_in_ignore_list;
+    };
+
+    struct Range {
+        uintptr_t begin;
+        uintptr_t end;
+    };
+
+    struct Table {
+        Entry entries[KNOWLEDGE_BASE_CAPACITY];
+        unsigned int count;
+        Range ranges[MAX_OBJECT_RANGE_COUNT]; // Executable segments of all loaded objects.
+        unsigned int range_count;
+    };
+
+    struct LoadedObjectsState {
+        unsigned long long adds;
+        unsigned long long subs;
+    };
+
+    struct ScanContext {
+        KnowledgeBase* knowledge_base;
+        Table* table;
+        unsigned int rule_count;
+        bool is_own_object;
+    };
+
+    static bool isKnownCode(const Table& table, uintptr_t ip) noexcept
+    {
+        const Range* range = std::upper_bound(table.ranges, table.ranges + table.range_count, ip - 1U,
+                                              [](uintptr_t address, const Range& candidate) { return address < candidate.begin; });
+        return range != table.ranges && ip - 1U < (range - 1)->end;
+    }
+
+    // Has to be invoked while m_mutex is held.
+    bool rebuild(bool is_forced) noexcept
+    {
+        LoadedObjectsState objects_state{};
+        dl_iterate_phdr(readLoadedObjectsState, &objects_state);
+        if (!is_forced && objects_state.adds == m_objects_state.adds && objects_state.subs == m_objects_state.subs)
+            return false;
+
+        unsigned int rule_count = 0;
+        for (const KnowledgeBaseRule& rule : g_builtin_rules)
+            m_rules[rule_count++] = rule;
+        rule_count = parseUserRules(m_white_list, true, false, rule_count);
+        rule_count = parseUserRules(m_ignore_list, false, true, rule_count);
+
+        // The table which is not in use right now is rebuilt and then published.
+        const unsigned int next = 1U - m_current.load(std::memory_order_relaxed);
+        Table& table = m_tables[next];
+        table.count = 0;
+        table.range_count = 0;
+
+        ScanContext context{ this, &table, rule_count, false };
+        dl_iterate_phdr(scanLoadedObject, &context);
+        std::sort(table.ranges, table.ranges + table.range_count, [](const Range& a, const Range& b) { return a.begin < b.begin; });
+
+        std::sort(table.entries, table.entries + table.count, [](const Entry& a, const Entry& b) {
+            return a.begin != b.begin ? a.begin < b.begin : a.end < b.end;
+        });
+        // The same function is usually found twice, in .dynsym and in .symtab.
+        table.count = static_cast<unsigned int>(std::unique(table.entries, table.entries + table.count, [](const Entry& a, const Entry& b) {
+                                                    return a.begin == b.begin && a.end == b.end && a.min_depth == b.min_depth &&
+                                                           a.max_depth == b.max_depth && a.is_in_white_list == b.is_in_white_list &&
+                                                           a.is_in_ignore_list == b.is_in_ignore_list;
+                                                }) -
+                                                table.entries);
+
+        m_current.store(next, std::memory_order_release);
+        m_objects_state = objects_state;
+        m_built = true;
+        m_unknown_code.clear();
+        return true;
+    }
+
+    static int readLoadedObjectsState(struct dl_phdr_info* info, size_t size, void* data) noexcept
+    {
+        if (size < offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs))
+            return 1;
+        auto state = static_cast<LoadedObjectsState*>(data);
+        state->adds = info->dlpi_adds;
+        state->subs = info->dlpi_subs;
+        return 1; // These counters are the same for all objects.
+    }
+
+    // Copies a value of an environment variable, returns true if it differs from the previously seen one.
+    static bool readUserRules(const char* env_var_name, char (&buffer)[MAX_USER_RULES_LENGTH]) noexcept
+    {
+        const char* env_var_val = getenv(env_var_name);
+        if (!env_var_val)
+            env_var_val = "";
+        if (strncmp(buffer, env_var_val, sizeof(buffer) - 1U) == 0)
+            return false;
+        if (strlen(env_var_val) >= sizeof(buffer))
+            fprintf(stderr, "%s is too long, only first %zu characters are used.\n", env_var_name, sizeof(buffer) - 1U);
+        strncpy(buffer, env_var_val, sizeof(buffer) - 1U);
+        buffer[sizeof(buffer) - 1U] = '\0';
+        return true;
+    }
+
+    // Splits a comma separated list in place, user defined rules apply to all depths.
+    unsigned int parseUserRules(char (&buffer)[MAX_USER_RULES_LENGTH], bool is_in_white_list, bool is_in_ignore_list, unsigned int rule_count) noexcept
+    {
+        memcpy(m_names_storage[is_in_white_list ? 0 : 1], buffer, sizeof(buffer));
+        char* name = m_names_storage[is_in_white_list ? 0 : 1];
+        while (*name) {
+            char* separator = strchr(name, ',');
+            if (separator)
+                *separator = '\0';
+            if (*name) {
+                if (rule_count == sizeof(m_rules) / sizeof(m_rules[0])) {
+                    fprintf(stderr, "Too many user defined knowledge base rules, %s is ignored.\n", name);
+                }
+                else {
+                    m_rules[rule_count++] = KnowledgeBaseRule{ name, 0U, KNOWLEDGE_BASE_DEPTH - 1U, is_in_white_list, is_in_ignore_list };
+                }
+            }
+            if (!separator)
+                break;
+            name = separator + 1;
+        }
+        return rule_count;
+    }
+
+    static int scanLoadedObject(struct dl_phdr_info* info, size_t, void* data) noexcept
+    {
+        auto context = static_cast<ScanContext*>(data);
+        KnowledgeBase* self = context->knowledge_base;
+
+        // Overthrower needs to know where its own code is located in order to skip its own frames.
+        const auto own_address = reinterpret_cast<uintptr_t>(&scanLoadedObject);
+        context->is_own_object = false;
+        for (unsigned int i = 0; i < info->dlpi_phnum; ++i) {
+            const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+            if (phdr.p_type != PT_LOAD || !(phdr.p_flags & PF_X))
+                continue;
+            const uintptr_t begin = info->dlpi_addr + phdr.p_vaddr;
+            const uintptr_t end = begin + phdr.p_memsz;
+            if (context->table->range_count < MAX_OBJECT_RANGE_COUNT)
+                context->table->ranges[context->table->range_count++] = Range{ begin, end };
+            if (own_address >= begin && own_address < end) {
+                self->m_own_begin = begin;
+                self->m_own_end = end;
+                context->is_own_object = true;
+            }
+        }
+
+        if (context->is_own_object)
+            return 0;
+
+        // The main executable has an empty name, vDSO does not have a file at all (its symbols are of no interest anyway).
+        const char* path = info->dlpi_name && *info->dlpi_name ? info->dlpi_name : "/proc/self/exe";
+        const int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return 0;
+
+        struct stat file_stat {};
+        void* image = MAP_FAILED;
+        if (fstat(fd, &file_stat) == 0 && static_cast<size_t>(file_stat.st_size) >= sizeof(ElfW(Ehdr)))
+            image = mmap(nullptr, static_cast<size_t>(file_stat.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (image == MAP_FAILED)
+            return 0;
+
+        scanSymbolTables(context, info->dlpi_addr, static_cast<const uint8_t*>(image), static_cast<size_t>(file_stat.st_size));
+        munmap(image, static_cast<size_t>(file_stat.st_size));
+        return 0;
+    }
+
+    static void scanSymbolTables(ScanContext* context, uintptr_t base, const uint8_t* image, size_t size) noexcept
+    {
+        const auto ehdr = reinterpret_cast<const ElfW(Ehdr)*>(image);
+        if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_shentsize != sizeof(ElfW(Shdr)) ||
+            ehdr->e_shoff + static_cast<size_t>(ehdr->e_shnum) * sizeof(ElfW(Shdr)) > size)
+            return;
+
+        const auto sections = reinterpret_cast<const ElfW(Shdr)*>(image + ehdr->e_shoff);
+        for (unsigned int i = 0; i < ehdr->e_shnum; ++i) {
+            const ElfW(Shdr)& section = sections[i];
+            if ((section.sh_type != SHT_SYMTAB && section.sh_type != SHT_DYNSYM) || section.sh_link >= ehdr->e_shnum ||
+                section.sh_entsize != sizeof(ElfW(Sym)) || section.sh_offset + section.sh_size > size)
+                continue;
+            const ElfW(Shdr)& strings = sections[section.sh_link];
+            if (strings.sh_offset + strings.sh_size > size)
+                continue;
+
+            const auto symbols = reinterpret_cast<const ElfW(Sym)*>(image + section.sh_offset);
+            const auto names = reinterpret_cast<const char*>(image + strings.sh_offset);
+            const size_t symbol_count = section.sh_size / sizeof(ElfW(Sym));
+
+            for (size_t j = 0; j < symbol_count; ++j) {
+                const ElfW(Sym)& symbol = symbols[j];
+                if (ELF64_ST_TYPE(symbol.st_info) != STT_FUNC || symbol.st_shndx == SHN_UNDEF || !symbol.st_size || symbol.st_name >= strings.sh_size)
+                    continue;
+                const char* name = names + symbol.st_name;
+                if (!memchr(name, '\0', strings.sh_size - symbol.st_name))
+                    continue;
+                context->knowledge_base->addEntries(*context, name, base + symbol.st_value, symbol.st_size);
+            }
+        }
+    }
+
+    void addEntries(ScanContext& context, const char* name, uintptr_t begin, size_t size) noexcept
+    {
+        for (unsigned int i = 0; i < context.rule_count; ++i) {
+            const KnowledgeBaseRule& rule = m_rules[i];
+            if (rule.name[0] != name[0] || strcmp(rule.name, name) != 0)
+                continue;
+            Table& table = *context.table;
+            if (table.count == KNOWLEDGE_BASE_CAPACITY)
+                return;
+            table.entries[table.count++] = Entry{ begin, begin + size, rule.min_depth, rule.max_depth, rule.is_in_white_list, rule.is_in_ignore_list };
+        }
+    }
+
+    Table m_tables[2]{};
+    std::atomic<unsigned int> m_current{};
+    std::mutex m_mutex;
+    UnknownCodeCache m_unknown_code;
+    bool m_built{};
+    LoadedObjectsState m_objects_state{};
+    uintptr_t m_own_begin{};
+    uintptr_t m_own_end{};
+    KnowledgeBaseRule m_rules[sizeof(g_builtin_rules) / sizeof(g_builtin_rules[0]) + MAX_USER_RULE_COUNT]{};
+    char m_white_list[MAX_USER_RULES_LENGTH]{};
+    char m_ignore_list[MAX_USER_RULES_LENGTH]{};
+    char m_names_storage[2][MAX_USER_RULES_LENGTH]{};
+};
+
+static KnowledgeBase g_knowledge_base; // NOLINT
+
+// Target library scope (OVERTHROWER_TARGET_LIBRARY): only allocation functions invoked right from code of the given object are failed and tracked.
+// A caller is matched by its return address against executable segments of all loaded objects, so no call stack is inspected
+// for allocations out of scope. Segments are rescanned whenever a return address does not belong to any known object,
+// so the target may also be loaded after activation (e.g. using dlopen). Code which still does not belong to any object
+// is remembered (see UnknownCodeCache) and is out of scope.
+#define MAX_SCOPE_RANGE_COUNT 1024U
+#define MAX_TARGET_LIBRARY_LENGTH 256U
+
+class TargetScope {
+public:
+    void build() noexcept
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const char* target = getenv("OVERTHROWER_TARGET_LIBRARY");
+        snprintf(m_target, sizeof(m_target), "%s", target ? target : "");
+        m_is_enabled = m_target[0] != '\0';
+        // The main executable has an empty name, it is matched using a path of its file.
+        const ssize_t length = readlink("/proc/self/exe", m_executable, sizeof(m_executable) - 1U);
+        m_executable[length > 0 ? length : 0] = '\0';
+        if (m_is_enabled)
+            scan();
+    }
+
+    bool isEnabled() const noexcept { return m_is_enabled; }
+
+    // Calls from overthrower itself are done on behalf of an allocation function which has already checked its own caller.
+    bool contains(uintptr_t ip) noexcept
+    {
+        if (g_knowledge_base.isOwnFrame(ip))
+            return true;
+        const int result = lookup(ip);
+        if (result >= 0)
+            return result > 0;
+        return !m_unknown_code.contains(ip) && rescan(ip);
+    }
+
+    const char* target() const noexcept { return m_target; }
+
+    void lock() noexcept { m_mutex.lock(); }
+    void unlock() noexcept { m_mutex.unlock(); }
+
+    unsigned int targetRangeCount() const noexcept
+    {
+        const Table& table = m_tables[m_current.load(std::memory_order_acquire)];
+        return static_cast<unsigned int>(std::count_if(table.ranges, table.ranges + table.count, [](const Range& range) { return range.is_target; }));
+    }
+
+private:
+    struct Range {
+        uintptr_t begin;
+        uintptr_t end;
+        bool is_target;
+    };
+
+    struct Table {
+        Range ranges[MAX_SCOPE_RANGE_COUNT];
+        unsigned int count;
+    };
+
+    // 1 - the target, 0 - some other object, -1 - unknown code.
+    int lookup(uintptr_t ip) const noexcept
+    {
+        const Table& table = m_tables[m_current.load(std::memory_order_acquire)];
+        // A return address may point right past the end of a function which never returns, ip - 1 is always inside the caller.
+        const Range* range = std::upper_bound(table.ranges, table.ranges + table.count, ip - 1U,
+                                              [](uintptr_t address, const Range& candidate) { return address < candidate.begin; });
+        if (range == table.ranges)
+            return -1;
+        --range;
+        return ip - 1U < range->end ? range->is_target : -1;
+    }
+
+    // Returns true if ip belongs to the target once segments are up to date.
+    bool rescan(uintptr_t ip) noexcept
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        unsigned long long adds = 0;
+        dl_iterate_phdr(readAdds, &adds);
+        if (adds != m_adds)
+            scan();
+        const int result = lookup(ip);
+        if (result < 0)
+            m_unknown_code.insert(ip);
+        return result > 0;
+    }
+
+    static int readAdds(struct dl_phdr_info* info, size_t size, void* data) noexcept
+    {
+        if (size >= offsetof(struct dl_phdr_info, dlpi_adds) + sizeof(info->dlpi_adds))
+            *static_cast<unsigned long long*>(data) = info->dlpi_adds;
+        return 1; // The counter is the same for all objects.
+    }
+
+    static int scanObject(struct dl_phdr_info* info, size_t size, void* data) noexcept
+    {
+        auto self = static_cast<TargetScope*>(data);
+        Table& table = self->m_tables[1U - self->m_current.load(std::memory_order_relaxed)];
+        if (size >= offsetof(struct dl_phdr_info, dlpi_adds) + sizeof(info->dlpi_adds))
+            self->m_adds = info->dlpi_adds;
+
+        // The target is matched by a file name, objects may be loaded from any directory.
+        const char* name = info->dlpi_name && *info->dlpi_name ? info->dlpi_name : self->m_executable;
+        const char* slash = strrchr(name, '/');
+        const bool is_target = *name && (strcmp(name, self->m_target) == 0 || strcmp(slash ? slash + 1 : name, self->m_target) == 0);
+        for (unsigned int i = 0; i < info->dlpi_phnum && table.count < MAX_SCOPE_RANGE_COUNT; ++i) {
+            const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+            if (phdr.p_type != PT_LOAD || !(phdr.p_flags & PF_X))
+                continue;
+            const uintptr_t begin = info->dlpi_addr + phdr.p_vaddr;
+            table.ranges[table.count++] = Range{ begin, begin + phdr.p_memsz, is_target };
+        }
+        return 0;
+    }
+
+    // The table which is not in use right now is rebuilt and then published, the same way as tables of the knowledge base.
+    void scan() noexcept
+    {
+        const unsigned int next = 1U - m_current.load(std::memory_order_relaxed);
+        m_tables[next].count = 0;
+        dl_iterate_phdr(scanObject, this);
+        std::sort(m_tables[next].ranges, m_tables[next].ranges + m_tables[next].count,
+                  [](const Range& a, const Range& b) { return a.begin < b.begin; });
+        m_current.store(next, std::memory_order_release);
+        m_unknown_code.clear();
+    }
+
+    Table m_tables[2];
+    std::atomic<unsigned int> m_current{ 0U };
+    std::mutex m_mutex;
+    UnknownCodeCache m_unknown_code;
+    unsigned long long m_adds = 0;
+    char m_target[MAX_TARGET_LIBRARY_LENGTH] = {};
+    char m_executable[PATH_MAX] = {};
+    bool m_is_enabled = false;
+};
+
+static TargetScope g_target_scope; // NOLINT
+#endif
+
+// Allocations out of scope (of another thread or library) take the same path as allocations of dormant overthrower.
+__attribute__((always_inline)) static inline bool isInScope(const void* caller) noexcept
+{
+    if (g_thread_scoped && g_state.scope_generation != g_random_generation.load(std::memory_order_relaxed))
+        return false;
+#if defined(PLATFORM_OS_LINUX)
+    if (g_target_scope.isEnabled())
+        return g_target_scope.contains(reinterpret_cast<uintptr_t>(caller));
+#else
+    (void)caller;
+#endif
+    return true;
+}
+
+extern "C" unsigned int deactivateOverthrower() noexcept;
+
+#if defined(PLATFORM_OS_LINUX)
+// dlsym may use calloc while native functions are being resolved, that is before native_calloc is known.
+// Such requests are served from a static buffer, blocks from this buffer are zeroed, never reused and never released.
+#define BOOTSTRAP_BUFFER_SIZE 8192U
+#define BOOTSTRAP_ALIGNMENT 16U
+
+alignas(BOOTSTRAP_ALIGNMENT) static char g_bootstrap_buffer[BOOTSTRAP_BUFFER_SIZE];
+static size_t g_bootstrap_used = 0;
+static bool g_resolving = false;
+
+static void* bootstrapCalloc(size_t count, size_t size) noexcept
+{
+    // Every block is preceded by its size, so it can be reallocated and asked for its usable size.
+    const size_t total = count * size;
+    const size_t required = BOOTSTRAP_ALIGNMENT + (total + BOOTSTRAP_ALIGNMENT - 1U) / BOOTSTRAP_ALIGNMENT * BOOTSTRAP_ALIGNMENT;
+    if ((size && total / size != count) || required > BOOTSTRAP_BUFFER_SIZE - g_bootstrap_used) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+
+    char* block = g_bootstrap_buffer + g_bootstrap_used;
+    g_bootstrap_used += required;
+    *reinterpret_cast<size_t*>(block) = total;
+    return block + BOOTSTRAP_ALIGNMENT;
+}
+
+static bool isBootstrapBlock(const void* pointer) noexcept
+{
+    return pointer >= g_bootstrap_buffer && pointer < g_bootstrap_buffer + BOOTSTRAP_BUFFER_SIZE;
+}
+
+static size_t bootstrapBlockSize(const void* pointer) noexcept
+{
+    return *reinterpret_cast<const size_t*>(static_cast<const char*>(pointer) - BOOTSTRAP_ALIGNMENT);
+}
+#endif
+
+#if defined(PLATFORM_OS_MAC_OS_X)
+static void initialize() noexcept
+{
+    assert(!g_initialized);
+    g_initializing = true;
+    g_state = {};
+    g_initializing = false;
+    g_initialized = true;
+}
+#elif defined(PLATFORM_OS_LINUX)
+static bool g_resolved = false;
+
+template<typename Function>
+static void resolveNativeFunction(Function& function, const char* name) noexcept
+{
+    // A function which is missing in the native allocator (e.g. aligned_alloc in old glibc) must never be invoked anyway.
+    auto native_function = reinterpret_cast<Function>(dlsym(RTLD_NEXT, name));
+    if (native_function)
+        function = native_function;
+}
+
+static void resolveNativeFunctions() noexcept
+{
+    if (g_resolved)
+        return;
+    g_resolving = true;
+    resolveNativeFunction(native_malloc, "malloc");
+    resolveNativeFunction(native_realloc, "realloc");
+    resolveNativeFunction(native_free, "free");
+    resolveNativeFunction(native_calloc, "calloc");
+    resolveNativeFunction(native_posix_memalign, "posix_memalign");
+    resolveNativeFunction(native_aligned_alloc, "aligned_alloc");
+    resolveNativeFunction(native_memalign, "memalign");
+    resolveNativeFunction(native_valloc, "valloc");
+    resolveNativeFunction(native_malloc_usable_size, "malloc_usable_size");
+    resolveNativeFunction(native_cxa_atexit, "__cxa_atexit");
+    g_resolving = false;
+    g_resolved = true;
+}
+
+static void* lazyMalloc(size_t size) noexcept
+{
+    if (g_resolving)
+        return bootstrapCalloc(1U, size);
+    resolveNativeFunctions();
+    return native_malloc(size);
+}
+
+static void* lazyRealloc(void* pointer, size_t size) noexcept
+{
+    resolveNativeFunctions();
+    return native_realloc(pointer, size);
+}
+
+static void lazyFree(void* pointer) noexcept
+{
+    resolveNativeFunctions();
+    native_free(pointer);
+}
+
+static void* lazyCalloc(size_t count, size_t size) noexcept
+{
+    if (g_resolving)
+        return bootstrapCalloc(count, size);
+    resolveNativeFunctions();
+    return native_calloc(count, size);
+}
+
+static int lazyPosixMemalign(void** pointer, size_t alignment, size_t size) noexcept
+{
+    resolveNativeFunctions();
+    return native_posix_memalign(pointer, alignment, size);
+}
+
+static void* lazyAlignedAlloc(size_t alignment, size_t size) noexcept
+{
+    resolveNativeFunctions();
+    return native_aligned_alloc(alignment, size);
+}
+
+static void* lazyMemalign(size_t alignment, size_t size) noexcept
+{
+    resolveNativeFunctions();
+    return native_memalign(alignment, size);
+}
+
+static void* lazyValloc(size_t size) noexcept
+{
+    resolveNativeFunctions();
+    return native_valloc(size);
+}
+
+static size_t lazyMallocUsableSize(void* pointer) noexcept
+{
+    resolveNativeFunctions();
+    return native_malloc_usable_size(pointer);
+}
+
+static int lazyCxaAtExit(void (*function)(void*), void* argument, void* dso_handle) noexcept
+{
+    resolveNativeFunctions();
+    return native_cxa_atexit(function, argument, dso_handle);
+}
+#endif
+
+static bool isQuietModeRequested() noexcept;
+
+__attribute__((constructor, used)) static void banner() noexcept
+{
+#if defined(PLATFORM_OS_LINUX)
+    resolveNativeFunctions();
+#endif
+    g_quiet = isQuietModeRequested();
+    announce("overthrower is waiting for the activation signal ...\n");
+    announce("Invoke activateOverthrower and overthrower will start his job.\n");
+}
+
+__attribute__((destructor, used)) static void shutdown() noexcept
+{
+    if (!g_activated)
+        return;
+
+    fprintf(stderr, "overthrower has not been deactivated explicitly, doing it anyway.\n");
+
+    deactivateOverthrower();
+}
+
+static int strToUnsignedLongInt(const char* str, unsigned long int* value) noexcept
+{
+    char* end_ptr;
+    errno = 0;
+    *value = strtoul(str, &end_ptr, 10);
+
+    if (end_ptr[0] != '\0')
+        return -1;
+
+    if ((*value == 0 || *value == ULONG_MAX) && errno == ERANGE)
+        return -1;
+
+    return 0;
+}
+
+// Random values for parameters which are not set are taken from a pool, which is filled by a single system call
+// (no stdio, no allocations) when a value is needed for the first time after activation.
+#define RANDOM_POOL_SIZE 8U
+
+static unsigned int g_random_pool[RANDOM_POOL_SIZE];
+static unsigned int g_random_pool_size = 0;
+
+static bool fillRandomPool() noexcept
+{
+#if defined(PLATFORM_OS_MAC_OS_X)
+    arc4random_buf(g_random_pool, sizeof(g_random_pool));
+    return true;
+#else
+    ssize_t size = -1;
+#if defined(SYS_getrandom)
+    do {
+        size = syscall(SYS_getrandom, g_random_pool, sizeof(g_random_pool), 0);
+    } while (size < 0 && errno == EINTR);
+#endif
+    if (size < 0) {
+        // A kernel older than 3.17, still be ready to all kinds oddities.
+        const int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        size = read(fd, g_random_pool, sizeof(g_random_pool));
+        close(fd);
+    }
+    return size == static_cast<ssize_t>(sizeof(g_random_pool));
+#endif
+}
+
+static unsigned int generateRandomValue(const unsigned int min_val, const unsigned int max_val) noexcept
+{
+    unsigned int value = (min_val + max_val) / 2;
+    if (g_random_pool_size || fillRandomPool()) {
+        g_random_pool_size = g_random_pool_size ? g_random_pool_size : RANDOM_POOL_SIZE;
+        value = g_random_pool[--g_random_pool_size];
+    }
+    value = value % (max_val - min_val + (max_val == UINT_MAX ? 0 : 1));
+    value += min_val;
+    return value;
+}
+
+static unsigned int readValFromEnvVar(const char* env_var_name,
+                                      unsigned int min_val,
+                                      unsigned int max_val,
+                                      unsigned int max_random_val = 0,
+                                      unsigned int default_value = UINT_MAX) noexcept
+{
+    const char* env_var_val = getenv(env_var_name);
+    unsigned long int value;
+
+    if (default_value != UINT_MAX) {
+        if (!env_var_val) {
+            return default_value;
+        }
+        if (strToUnsignedLongInt(env_var_val, &value) || value < min_val || value > max_val) {
+            fprintf(stderr, "%s has incorrect value (%s). Using a default value (%u).\n", env_var_name, env_var_val, default_value);
+            return default_value;
+        }
+        return static_cast<unsigned int>(value);
+    }
+
+    if (!env_var_val) {
+        const unsigned int random_value = generateRandomValue(min_val, max_random_val ? max_random_val : max_val);
+        announce("%s environment variable not set. Using a random value (%u).\n", env_var_name, random_value);
+        return random_value;
+    }
+    else if (strToUnsignedLongInt(env_var_val, &value) || value < min_val || value > max_val) {
+        const unsigned int random_value = generateRandomValue(min_val, max_random_val ? max_random_val : max_val);
+        fprintf(stderr, "%s has incorrect value (%s). Using a random value (%u).\n", env_var_name, env_var_val, random_value);
+        return random_value;
+    }
+
+    return static_cast<unsigned int>(value);
+}
+
+static bool isQuietModeRequested() noexcept
+{
+    return readValFromEnvVar("OVERTHROWER_QUIET", 0U, 1U, 0U, 0U) != 0;
+}
+
+// Fault space exploration: a child process is forked per allocation index, child k fails exactly allocation k (pulse semantics)
+// and reports its outcome through a pipe once it is deactivated. Outcomes of all children are collected into a single report.
+#define MAX_EXPLORATION_JOBS 1024U
+
+enum ExplorationOutcome {
+    EXPLORATION_PENDING,
+    EXPLORATION_DEACTIVATED, // Deactivated, count of leaked blocks is known.
+    EXPLORATION_NOT_REACHED, // Deactivated before allocation k has been invoked, exploration ends here.
+    EXPLORATION_EXITED,      // Exited without being deactivated.
+    EXPLORATION_SIGNALED,    // Terminated by a signal (crashed).
+};
+
+// Sent by a child, small enough to be written to a pipe atomically.
+struct ExplorationRecord {
+    unsigned int seq_num;
+    unsigned int blocks_leaked;
+    bool is_reached;
+};
+
+struct ExplorationResult {
+    ExplorationOutcome outcome;
+    unsigned int blocks_leaked;
+    int code; // Exit code or a number of a signal.
+};
+
+static int g_exploration_fd = -1; // Write end of the pipe, valid in children only.
+static unsigned int g_exploration_seq_num = 0;
+
+static void reportExploration(const ExplorationResult* results, unsigned int count, unsigned int job_count) noexcept
+{
+    unsigned int passed = 0;
+    unsigned int leaking = 0;
+    unsigned int exited = 0;
+    unsigned int crashed = 0;
+
+    ReportWriter writer;
+    writer.text("overthrower has explored ").decimal(count).text(" allocation(s) using ").decimal(job_count).text(" job(s):\n");
+    for (unsigned int seq_num = 0; seq_num < count; ++seq_num) {
+        const ExplorationResult& result = results[seq_num];
+        writer.decimal(seq_num, 8).text("  -  ");
+        switch (result.outcome) {
+            case EXPLORATION_DEACTIVATED:
+                writer.text(result.blocks_leaked ? "leaked " : "passed ").decimal(result.blocks_leaked).text(" block(s)\n");
+                ++(result.blocks_leaked ? leaking : passed);
+                break;
+            case EXPLORATION_EXITED:
+                writer.text("exited with code ").decimal(static_cast<unsigned int>(result.code)).text(" before deactivation\n");
+                ++exited;
+                break;
+            case EXPLORATION_SIGNALED:
+                writer.text("crashed (signal ").decimal(static_cast<unsigned int>(result.code)).text(")\n");
+                ++crashed;
+                break;
+            case EXPLORATION_PENDING:
+            case EXPLORATION_NOT_REACHED:
+            default:
+                writer.text("not explored\n");
+                break;
+        }
+    }
+    writer.text("^^^^^^^^  |  ^^^^^^^\n");
+    writer.text("  malloc  |  outcome\n");
+    writer.text("invocation|\n");
+    writer.text("  number  |\n");
+    writer.decimal(passed).text(" passed, ").decimal(leaking).text(" leaked, ").decimal(exited).text(" exited, ");
+    writer.decimal(crashed).text(" crashed\n");
+}
+
+// Returns true in a child process which has to fail allocation g_exploration_seq_num, false in the parent once exploration is done.
+static bool exploreFaultSpace(unsigned int limit, unsigned int job_count) noexcept
+{
+    struct Job {
+        pid_t pid;
+        unsigned int seq_num;
+    };
+
+    Job jobs[MAX_EXPLORATION_JOBS];
+    int fds[2] = { -1, -1 };
+    auto results = static_cast<ExplorationResult*>(nonFailingMalloc(limit * sizeof(ExplorationResult)));
+    if (!results || pipe(fds) != 0) {
+        fprintf(stderr, "overthrower is unable to explore allocations (%s).\n", results ? "no pipe" : "out of memory");
+        nonFailingFree(results);
+        return false;
+    }
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    for (unsigned int i = 0; i < limit; ++i)
+        results[i] = ExplorationResult{ EXPLORATION_PENDING, 0U, 0 };
+
+    // Buffered output must not be flushed by every child once again.
+    fflush(nullptr);
+
+    unsigned int next = 0;
+    unsigned int end = limit; // Allocations starting from the first one which has not been reached are never reached.
+    unsigned int running = 0;
+    while (next < end || running) {
+        if (next < end && running < job_count) {
+            const pid_t pid = fork();
+            if (pid == 0) {
+                close(fds[0]);
+                g_exploration_fd = fds[1];
+                g_exploration_seq_num = next;
+                nonFailingFree(results);
+                return true;
+            }
+            if (pid > 0) {
+                jobs[running++] = Job{ pid, next++ };
+                continue;
+            }
+            if (!running) {
+                fprintf(stderr, "overthrower is unable to fork a child process, exploration is stopped.\n");
+                end = next;
+                break;
+            }
+        }
+
+        // Only own children are waited for, children of the program itself must stay untouched.
+        bool is_any_finished = false;
+        for (unsigned int i = 0; i < running;) {
+            int status = 0;
+            if (waitpid(jobs[i].pid, &status, WNOHANG) != jobs[i].pid) {
+                ++i;
+                continue;
+            }
+            is_any_finished = true;
+
+            ExplorationRecord record{};
+            while (read(fds[0], &record, sizeof(record)) == static_cast<ssize_t>(sizeof(record))) {
+                if (record.seq_num < limit)
+                    results[record.seq_num] = ExplorationResult{ record.is_reached ? EXPLORATION_DEACTIVATED : EXPLORATION_NOT_REACHED, record.blocks_leaked, 0 };
+            }
+
+            ExplorationResult& result = results[jobs[i].seq_num];
+            if (WIFSIGNALED(status))
+                result = ExplorationResult{ EXPLORATION_SIGNALED, 0U, WTERMSIG(status) };
+            else if (result.outcome == EXPLORATION_PENDING)
+                result = ExplorationResult{ EXPLORATION_EXITED, 0U, WIFEXITED(status) ? WEXITSTATUS(status) : 0 };
+            if (result.outcome == EXPLORATION_NOT_REACHED)
+                end = std::min(end, jobs[i].seq_num);
+
+            jobs[i] = jobs[--running];
+        }
+
+        if (!is_any_finished)
+            usleep(1000);
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+    reportExploration(results, end, job_count);
+    nonFailingFree(results);
+    return false;
+}
+
+// Function names are demangled when possible, demangled_name (if any) has to be released using free.
+struct FrameSymbol {
+    const char* file_name;
+    const char* func_name;
+    uintptr_t offset; // Offset of a return address from the beginning of a function.
+    char* demangled_name;
+};
+
+static FrameSymbol symbolizeReturnAddress(uintptr_t ip) noexcept
+{
+    FrameSymbol symbol{ "???", "???", 0U, nullptr };
+    Dl_info dl_info;
+
+    // A return address may point right past the end of a function which never returns, ip - 1 is always inside the caller.
+    if (dladdr(reinterpret_cast<void*>(ip - 1U), &dl_info)) {
+        if (dl_info.dli_fname && *dl_info.dli_fname)
+            symbol.file_name = dl_info.dli_fname;
+        if (dl_info.dli_sname) {
+            int status;
+            symbol.func_name = dl_info.dli_sname;
+            symbol.offset = ip - reinterpret_cast<uintptr_t>(dl_info.dli_saddr);
+            symbol.demangled_name = abi::__cxa_demangle(dl_info.dli_sname, nullptr, nullptr, &status);
+            if (status == 0)
+                symbol.func_name = symbol.demangled_name;
+        }
+    }
+    return symbol;
+}
+
+// Live heap snapshots: tracked blocks are copied from the registry shard by shard, so an allocating thread may wait
+// only while a single shard is copied, and written as a compact binary file (native byte order):
+// SnapshotHeader, block_count SnapshotBlock records, site_count sites. A site is SnapshotSite followed by frame_count frames,
+// a frame is SnapshotFrame followed by a name of an object and a name of a function (not terminated).
+// Blocks refer to sites by call site cache identifiers, which are only meaningful within a snapshot: a slot of the cache which
+// has been invalidated (on activation) may be taken by another call chain. So every site also has a stable identifier
+// (see stableSiteHash) which is the same for the same call chain during the life of a process, snapshot_diff.py compares sites by it.
+// When OVERTHROWER_SNAPSHOT_SIGNAL is given, a helper thread writes OVERTHROWER_SNAPSHOT_FILE.1, .2, ... whenever the signal is delivered.
+#define SNAPSHOT_MAGIC "OVTHSNAP"
+#define SNAPSHOT_VERSION 2U
+#define SNAPSHOT_DEFAULT_FILE "overthrower.snapshot"
+#define MAX_SNAPSHOT_FILE_LENGTH 4096U
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_record_size;
+    uint64_t block_count;
+    uint64_t site_count;
+};
+
+struct SnapshotBlock {
+    uint64_t address;
+    uint64_t size;
+    uint32_t seq_num;
+    uint32_t site;
+};
+
+struct SnapshotSite {
+    uint32_t site;
+    uint32_t frame_count;
+    uint64_t stable_id;
+};
+
+struct SnapshotFrame {
+    uint64_t ip;
+    uint64_t offset;
+    uint16_t file_name_length;
+    uint16_t func_name_length;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(SnapshotHeader) == 32U && sizeof(SnapshotBlock) == 24U && sizeof(SnapshotSite) == 16U && sizeof(SnapshotFrame) == 24U,
+              "Unexpected layout of a snapshot");
+
+static std::mutex g_snapshot_mutex; // Guards g_snapshot_sites, snapshots are written one at a time.
+static bool g_snapshot_sites[CALL_SITE_CACHE_SIZE + 1U];
+static int g_snapshot_signal = 0;
+static int g_snapshot_pipe[2] = { -1, -1 };
+static pthread_t g_snapshot_thread;
+static struct sigaction g_snapshot_old_action;
+static char g_snapshot_file[MAX_SNAPSHOT_FILE_LENGTH];
+static unsigned int g_snapshot_count = 0; // Never reset, so snapshots of previous activations are never overwritten.
+
+// Returns a count of blocks in a snapshot, -1 if it can not be written.
+static long long writeSnapshot(const char* path) noexcept
+{
+    std::lock_guard<std::mutex> lock(g_snapshot_mutex);
+    const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+
+    SnapshotHeader header{};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.block_record_size = sizeof(SnapshotBlock);
+    memset(g_snapshot_sites, 0, sizeof(g_snapshot_sites));
+
+    bool is_complete = true;
+    {
+        ReportWriter writer(fd);
+        writer.bytes(&header, sizeof(header)); // Counts are patched once everything is written.
+
+        Registry::Slot* buffer = nullptr;
+        size_t buffer_capacity = 0;
+        for (unsigned int shard = 0; shard < REGISTRY_SHARD_COUNT; ++shard) {
+            const size_t count = g_registry.copyShard(shard, buffer, buffer_capacity);
+            if (count == SIZE_MAX) {
+                is_complete = false; // Real OOM
+                break;
+            }
+            for (size_t i = 0; i < count; ++i) {
+                const Registry::Slot& slot = buffer[i];
+                const unsigned int site = slot.info.site <= CALL_SITE_CACHE_SIZE ? slot.info.site : 0U;
+                const SnapshotBlock block{ reinterpret_cast<uintptr_t>(slot.pointer), slot.info.size, slot.info.seq_num, site };
+                writer.bytes(&block, sizeof(block));
+                g_snapshot_sites[site] = true;
+            }
+            header.block_count += count;
+        }
+        nonFailingUnmap(buffer, buffer_capacity * sizeof(Registry::Slot));
+
+        // Only sites which own at least one block are symbolized.
+        for (unsigned int site = 0; is_complete && site <= CALL_SITE_CACHE_SIZE; ++site) {
+            if (!g_snapshot_sites[site])
+                continue;
+
+            uintptr_t ips[CALL_SITE_DEPTH];
+            const unsigned int frame_count = g_call_site_cache.callChain(site, ips);
+            const SnapshotSite record{ site, frame_count, stableSiteHash(site) };
+            writer.bytes(&record, sizeof(record));
+            for (unsigned int depth = 0; depth < frame_count; ++depth) {
+                const FrameSymbol symbol = symbolizeReturnAddress(ips[depth]);
+                const auto file_name_length = static_cast<uint16_t>(std::min<size_t>(strlen(symbol.file_name), UINT16_MAX));
+                const auto func_name_length = static_cast<uint16_t>(std::min<size_t>(strlen(symbol.func_name), UINT16_MAX));
+                const SnapshotFrame frame{ ips[depth], symbol.offset, file_name_length, func_name_length, 0U };
+                writer.bytes(&frame, sizeof(frame)).bytes(symbol.file_name, file_name_length).bytes(symbol.func_name, func_name_length);
+                free(symbol.demangled_name);
+            }
+            ++header.site_count;
+        }
+    }
+
+    if (is_complete)
+        is_complete = pwrite(fd, &header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header));
+    close(fd);
+    return is_complete ? static_cast<long long>(header.block_count) : -1;
+}
+
+// Nothing but write(2) is allowed here: the interrupted thread may hold a lock of a shard, a snapshot is written by the helper thread.
+static void snapshotSignalHandler(int) noexcept
+{
+    const int old_errno = errno;
+    const char request = 1;
+    while (write(g_snapshot_pipe[1], &request, sizeof(request)) < 0 && errno == EINTR) {
+    }
+    errno = old_errno;
+}
+
+static void* snapshotThread(void*) noexcept
+{
+#if defined(PLATFORM_OS_MAC_OS_X)
+    initialize();
+#endif
+    // Allocations of the helper thread (symbolization) are never failed, counted or tracked.
+    g_state.is_tracing = true;
+    for (;;) {
+        char request = 0;
+        const ssize_t result = read(g_snapshot_pipe[0], &request, sizeof(request));
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0 || !request)
+            break;
+
+        char path[MAX_SNAPSHOT_FILE_LENGTH + 16U];
+        snprintf(path, sizeof(path), "%s.%u", g_snapshot_file, ++g_snapshot_count);
+        const long long block_count = writeSnapshot(path);
+        if (block_count < 0)
+            fprintf(stderr, "overthrower is unable to write a snapshot to %s.\n", path);
+        else
+            announce("overthrower has written a snapshot of %lld block(s) to %s.\n", block_count, path);
+    }
+    return nullptr;
+}
+
+static void stopSnapshotThread() noexcept;
+
+static void startSnapshotThread(int signal_number) noexcept
+{
+    stopSnapshotThread(); // Activated again without being deactivated.
+
+    const char* file = getenv("OVERTHROWER_SNAPSHOT_FILE");
+    snprintf(g_snapshot_file, sizeof(g_snapshot_file), "%s", file && *file ? file : SNAPSHOT_DEFAULT_FILE);
+
+    if (pipe(g_snapshot_pipe)) {
+        fprintf(stderr, "overthrower is unable to create a pipe, snapshots are disabled.\n");
+        return;
+    }
+    fcntl(g_snapshot_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(g_snapshot_pipe[1], F_SETFD, FD_CLOEXEC);
+    // Requests which do not fit into the pipe are dropped, the signal handler never blocks.
+    fcntl(g_snapshot_pipe[1], F_SETFL, fcntl(g_snapshot_pipe[1], F_GETFL) | O_NONBLOCK);
+
+    if (pthread_create(&g_snapshot_thread, nullptr, snapshotThread, nullptr)) {
+        fprintf(stderr, "overthrower is unable to start a thread, snapshots are disabled.\n");
+        close(g_snapshot_pipe[0]);
+        close(g_snapshot_pipe[1]);
+        g_snapshot_pipe[0] = g_snapshot_pipe[1] = -1;
+        return;
+    }
+
+    struct sigaction action {};
+    action.sa_handler = snapshotSignalHandler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(signal_number, &action, &g_snapshot_old_action);
+    g_snapshot_signal = signal_number;
+    announce("Snapshot files = %s.N\n", g_snapshot_file);
+}
+
+static void stopSnapshotThread() noexcept
+{
+    if (!g_snapshot_signal)
+        return;
+
+    sigaction(g_snapshot_signal, &g_snapshot_old_action, nullptr);
+    g_snapshot_signal = 0;
+
+    // The write end is non blocking, a full pipe still wakes the thread up, the stop request is sent once it is drained.
+    const char request = 0;
+    while (write(g_snapshot_pipe[1], &request, sizeof(request)) < 0 && (errno == EINTR || errno == EAGAIN))
+        usleep(1000);
+    pthread_join(g_snapshot_thread, nullptr);
+    close(g_snapshot_pipe[0]);
+    close(g_snapshot_pipe[1]);
+    g_snapshot_pipe[0] = g_snapshot_pipe[1] = -1;
+}
+
+// Deferred traces (OVERTHROWER_DEFERRED_TRACES=1): in verbose modes an allocating thread only captures raw return addresses
+// into a ring buffer, a helper thread symbolizes them (every distinct address once) and prints traces, so verbose modes barely change timing.
+// Producers claim records with a CAS on the head and never overwrite records which have not been printed yet, a trace is dropped
+// (and counted) instead when the ring is full. Records are printed in the order they have been claimed in.
+#define TRACE_RING_CAPACITY 4096U // Has to be a power of two.
+#define TRACE_DEPTH 64U
+#define TRACE_NAME_CACHE_SIZE 8192U              // Has to be a power of two.
+#define TRACE_NAME_ARENA_SIZE (4U * 1024U * 1024U) // Symbolized names of distinct return addresses.
+#define TRACE_NAME_MAX_PROBES 16U
+
+struct TraceRecord {
+    std::atomic<uint64_t> ticket; // Ticket + 1 once the record is published, stale values mean the record is being written.
+    unsigned int seq_num;
+    unsigned int count;
+    bool is_failed;
+    uintptr_t ips[TRACE_DEPTH];
+};
+
+struct TraceName {
+    uintptr_t ip;
+    const char* text; // "<object> - <function> + 0x<offset>", points into the arena.
+};
+
+static TraceRecord* g_trace_ring = nullptr;
+static CacheLineAtomic<uint64_t> g_trace_head{};
+static CacheLineAtomic<uint64_t> g_trace_tail{};
+static CacheLineAtomic<uint64_t> g_traces_dropped{};
+static std::atomic<bool> g_trace_thread_stop{ false };
+static std::atomic<bool> g_trace_thread_idle{ false }; // The helper thread is going to wait for a byte from the pipe.
+static int g_trace_pipe[2] = { -1, -1 };
+static pthread_t g_trace_thread{};
+static bool g_trace_thread_started = false;
+static TraceName* g_trace_names = nullptr;
+static char* g_trace_arena = nullptr;
+static size_t g_trace_arena_size = 0;
+
+// The write end is non blocking, a byte which does not fit wakes the thread up anyway.
+static void wakeTraceThread() noexcept
+{
+    const char request = 1;
+    while (write(g_trace_pipe[1], &request, sizeof(request)) < 0 && errno == EINTR) {
+    }
+}
+
+// Invoked by an allocating thread instead of printing a trace, costs a stack capture and a CAS (and a write if the helper thread is idle).
+__attribute__((noinline)) static void deferTrace(bool is_failed, unsigned int malloc_seq_num) noexcept
+{
+    uint64_t ticket = g_trace_head.load(std::memory_order_relaxed);
+    do {
+        if (ticket - g_trace_tail.load(std::memory_order_acquire) >= TRACE_RING_CAPACITY) {
+            g_traces_dropped.fetch_add(1U, std::memory_order_relaxed);
+            return;
+        }
+    } while (!g_trace_head.compare_exchange_weak(ticket, ticket + 1U, std::memory_order_relaxed));
+
+    TraceRecord& record = g_trace_ring[ticket % TRACE_RING_CAPACITY];
+    record.seq_num = malloc_seq_num;
+    record.is_failed = is_failed;
+    record.count = captureStack(record.ips, TRACE_DEPTH);
+    record.ticket.store(ticket + 1U, std::memory_order_release);
+
+    // Pairs with the fence in traceThread: either the helper thread sees the record or it is woken up.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (g_trace_thread_idle.load(std::memory_order_relaxed) && g_trace_thread_idle.exchange(false, std::memory_order_relaxed))
+        wakeTraceThread();
+}
+
+// Traces are printed by one thread at a time (the helper thread or a deactivating one once the helper has stopped).
+static const char* traceName(uintptr_t ip) noexcept
+{
+    size_t index = (ip >> 4U) & (TRACE_NAME_CACHE_SIZE - 1U);
+    unsigned int probe = 0;
+    for (; probe < TRACE_NAME_MAX_PROBES && g_trace_names[index].ip; ++probe) {
+        if (g_trace_names[index].ip == ip)
+            return g_trace_names[index].text;
+        index = (index + 1U) & (TRACE_NAME_CACHE_SIZE - 1U);
+    }
+
+    const FrameSymbol symbol = symbolizeReturnAddress(ip);
+    static char text[1024];
+    snprintf(text, sizeof(text), "%s - %s + 0x%" PRIxPTR, symbol.file_name, symbol.func_name, symbol.offset);
+    free(symbol.demangled_name);
+
+    // Once the cache is crowded or the arena is full, names are symbolized every time instead of being cached.
+    const size_t length = strlen(text) + 1U;
+    if (probe == TRACE_NAME_MAX_PROBES || g_trace_arena_size + length > TRACE_NAME_ARENA_SIZE)
+        return text;
+    char* name = g_trace_arena + g_trace_arena_size;
+    memcpy(name, text, length);
+    g_trace_arena_size += length;
+    g_trace_names[index] = TraceName{ ip, name };
+    return name;
+}
+
+static void printTraceRecord(const TraceRecord& record) noexcept
+{
+    ReportWriter writer;
+    writer.text("\n### ").text(record.is_failed ? "Failed" : "Successful").text(" allocation, sequential number: ");
+    writer.decimal(record.seq_num).text(" ###\n");
+#if defined(PLATFORM_OS_LINUX)
+    // Frames of overthrower itself are of no interest, the same way as in searchKnowledgeBase.
+    unsigned int first = 0;
+    while (first < record.count && g_knowledge_base.isOwnFrame(record.ips[first]))
+        ++first;
+#else
+    const unsigned int first = std::min(record.count, 1U);
+#endif
+    for (unsigned int depth = first; depth < record.count; ++depth) {
+        writer.text("#").decimal(depth - first + 1U, 2, true).text(" 0x").hex(record.ips[depth], 16);
+        writer.text(" ").text(traceName(record.ips[depth])).text("\n");
+    }
+}
+
+// Prints all published records, returns false if there were none.
+static bool drainTraces() noexcept
+{
+    bool is_drained = false;
+    for (uint64_t tail = g_trace_tail.load(std::memory_order_relaxed);; ++tail) {
+        TraceRecord& record = g_trace_ring[tail % TRACE_RING_CAPACITY];
+        if (record.ticket.load(std::memory_order_acquire) != tail + 1U)
+            return is_drained; // Not claimed or not written yet.
+        printTraceRecord(record);
+        g_trace_tail.store(tail + 1U, std::memory_order_release);
+        is_drained = true;
+    }
+}
+
+static void* traceThread(void*) noexcept
+{
+#if defined(PLATFORM_OS_MAC_OS_X)
+    initialize();
+#endif
+    // Allocations of the helper thread (symbolization) are never failed, counted or tracked.
+    g_state.is_tracing = true;
+    while (!g_trace_thread_stop.load(std::memory_order_acquire)) {
+        if (drainTraces())
+            continue;
+        // Pairs with the fence in deferTrace: a record published before the flag has been raised is drained right away.
+        g_trace_thread_idle.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (drainTraces()) {
+            g_trace_thread_idle.store(false, std::memory_order_relaxed);
+            continue;
+        }
+        char request = 0;
+        while (read(g_trace_pipe[0], &request, sizeof(request)) < 0 && errno == EINTR) {
+        }
+    }
+    return nullptr;
+}
+
+static void startTraceThread() noexcept
+{
+    if (!g_trace_ring) {
+        // Mapped once and never released, a thread may be writing a record while overthrower is being deactivated.
+        g_trace_ring = static_cast<TraceRecord*>(nonFailingMap(TRACE_RING_CAPACITY * sizeof(TraceRecord)));
+        g_trace_names = static_cast<TraceName*>(nonFailingMap(TRACE_NAME_CACHE_SIZE * sizeof(TraceName)));
+        g_trace_arena = static_cast<char*>(nonFailingMap(TRACE_NAME_ARENA_SIZE));
+        if (!g_trace_ring || !g_trace_names || !g_trace_arena) {
+            fprintf(stderr, "overthrower is unable to allocate a ring buffer, traces are printed immediately.\n");
+            g_deferred_traces = false;
+            return;
+        }
+    }
+
+    // Return addresses may belong to objects which have been unloaded since the previous activation.
+    memset(static_cast<void*>(g_trace_names), 0, TRACE_NAME_CACHE_SIZE * sizeof(TraceName));
+    g_trace_arena_size = 0;
+    g_traces_dropped = 0;
+    g_trace_thread_stop = false;
+    g_trace_thread_idle = false;
+    // Created once and never closed, the same way as the ring: a thread may be waking the helper up while overthrower is being deactivated.
+    if (g_trace_pipe[0] < 0) {
+        if (pipe(g_trace_pipe)) {
+            fprintf(stderr, "overthrower is unable to create a pipe, traces are printed on deactivation.\n");
+            g_trace_pipe[0] = g_trace_pipe[1] = -1;
+            return;
+        }
+        fcntl(g_trace_pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(g_trace_pipe[1], F_SETFD, FD_CLOEXEC);
+        fcntl(g_trace_pipe[1], F_SETFL, fcntl(g_trace_pipe[1], F_GETFL) | O_NONBLOCK);
+    }
+    g_trace_thread_started = pthread_create(&g_trace_thread, nullptr, traceThread, nullptr) == 0;
+    if (!g_trace_thread_started)
+        fprintf(stderr, "overthrower is unable to start a thread, traces are printed on deactivation.\n");
+}
+
+static void stopTraceThread() noexcept
+{
+    if (g_trace_thread_started) {
+        g_trace_thread_stop = true;
+        wakeTraceThread();
+        pthread_join(g_trace_thread, nullptr);
+        g_trace_thread_started = false;
+        g_trace_thread_idle = false;
+    }
+
+    const bool old_is_tracing = g_state.is_tracing;
+    g_state.is_tracing = true;
+    drainTraces();
+    g_state.is_tracing = old_is_tracing;
+
+    const uint64_t dropped = g_traces_dropped.load(std::memory_order_relaxed);
+    if (dropped) {
+        ReportWriter writer;
+        writer.text("overthrower has dropped ").decimal(dropped).text(" trace(s), the ring buffer was full.\n");
+    }
+}
+
+// Fork handling: all locks of overthrower are taken before fork and released in both processes afterwards,
+// so a child never inherits a lock held by a thread which does not exist in the child. The snapshot mutex is an exception,
+// it is held while a whole snapshot is written and fork would wait for that long, a child gets a new one instead.
+// Helper threads do not exist in a child either,
+// so a child neither writes snapshots nor prints deferred traces in background (they are printed on deactivation of the child).
+// The registry of a child is handled according to OVERTHROWER_FORK_POLICY. Once a child execs, overthrower is loaded anew and is dormant.
+static void prepareFork() noexcept
+{
+#if defined(PLATFORM_OS_LINUX)
+    g_knowledge_base.lock();
+    g_target_scope.lock();
+#endif
+    g_registry.lockAll();
+}
+
+static void resumeAfterFork() noexcept
+{
+    g_registry.unlockAll();
+#if defined(PLATFORM_OS_LINUX)
+    g_target_scope.unlock();
+    g_knowledge_base.unlock();
+#endif
+}
+
+static void resumeForkedChild() noexcept
+{
+    if (g_snapshot_signal) {
+        sigaction(g_snapshot_signal, &g_snapshot_old_action, nullptr);
+        g_snapshot_signal = 0;
+        close(g_snapshot_pipe[0]);
+        close(g_snapshot_pipe[1]);
+        g_snapshot_pipe[0] = g_snapshot_pipe[1] = -1;
+    }
+    // Snapshot sites are cleared whenever a snapshot is started, whatever a thread of the parent has left there is of no interest.
+    new (&g_snapshot_mutex) std::mutex;
+
+    // Records which have not been printed yet belong to the parent, which prints them. A record claimed by a thread of the parent
+    // will never be published in the child, so the child starts right after the last claimed record.
+    // The pipe is shared with the helper thread of the parent, the child gets its own one once it starts a helper thread.
+    g_trace_thread_started = false;
+    g_trace_thread_idle = false;
+    if (g_trace_pipe[0] >= 0) {
+        close(g_trace_pipe[0]);
+        close(g_trace_pipe[1]);
+        g_trace_pipe[0] = g_trace_pipe[1] = -1;
+    }
+    g_trace_tail.store(g_trace_head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    g_traces_dropped = 0;
+
+    // Children of fault space exploration are forked before activation is complete, they always inherit everything.
+    if (g_activated && g_fork_policy != FORK_INHERIT) {
+        g_registry.forget();
+        resetStats();
+        g_untracked_blocks = 0;
+        g_activated = g_fork_policy != FORK_DORMANT;
+    }
+    resumeAfterFork();
+}
+
+static void installForkHandlers() noexcept
+{
+    static bool is_installed = false;
+    if (!is_installed && pthread_atfork(prepareFork, resumeAfterFork, resumeForkedChild) == 0)
+        is_installed = true;
+}
+
+// Tracked blocks of the current activation are written to path, a count of written blocks or -1 is returned.
+extern "C" __attribute__((visibility("default"))) long long writeOverthrowerSnapshot(const char* path) noexcept
+{
+    if (!path || !*path)
+        return -1;
+
+#if defined(PLATFORM_OS_MAC_OS_X)
+    if (!g_initialized)
+        initialize();
+#endif
+
+    // Allocations done while a snapshot is being written are never failed, counted or tracked.
+    const bool old_is_tracing = g_state.is_tracing;
+    g_state.is_tracing = true;
+    const long long block_count = writeSnapshot(path);
+    g_state.is_tracing = old_is_tracing;
+    return block_count;
+}
+
+// A strategy has to be installed before activation, it replaces the one which is chosen by OVERTHROWER_STRATEGY.
+extern "C" __attribute__((visibility("default"))) void setOverthrowerStrategy(OverthrowerStrategyCallback callback, void* user_data) noexcept
+{
+    if (g_activated) {
+        fprintf(stderr, "overthrower can not change a strategy while being activated.\n");
+        return;
+    }
+
+    g_strategy_callback = OverthrowerStrategy{ callback, user_data };
+}
+
+extern "C" __attribute__((visibility("default"))) int
+overthrowerSizeThresholdStrategy(unsigned int, size_t size, unsigned long, unsigned int, void* user_data) noexcept
+{
+    return size >= static_cast<const OverthrowerSizeThreshold*>(user_data)->min_size;
+}
+
+extern "C" __attribute__((visibility("default"))) int
+overthrowerEveryNthStrategy(unsigned int seq_num, size_t, unsigned long, unsigned int, void* user_data) noexcept
+{
+    const auto every_nth = static_cast<const OverthrowerEveryNth*>(user_data);
+    return every_nth->period && seq_num >= every_nth->offset && (seq_num - every_nth->offset) % every_nth->period == 0;
+}
+
+extern "C" __attribute__((visibility("default"))) int
+overthrowerCompositeStrategy(unsigned int seq_num, size_t size, unsigned long thread_id, unsigned int site, void* user_data) noexcept
+{
+    const auto composite = static_cast<const OverthrowerComposite*>(user_data);
+    const bool require_all = composite->mode == OVERTHROWER_COMPOSITE_ALL;
+    for (unsigned int i = 0; i < composite->count; ++i) {
+        const OverthrowerStrategy& strategy = composite->strategies[i];
+        const bool is_failed = strategy.callback(seq_num, size, thread_id, site, strategy.user_data) != 0;
+        if (is_failed != require_all)
+            return is_failed;
+    }
+    return require_all && composite->count;
+}
+
+extern "C" __attribute__((visibility("default"))) void activateOverthrower() noexcept
+{
+#if defined(PLATFORM_OS_MAC_OS_X)
+    // Mac OS X implementation uses malloc inside printf generation of functions. If malloc fail, printf-like functions may crash.
+    // To prevent crashes we have to force printf to do all his allocations before we activate the overthrower.
+    static const int integer_number = 22708089;
+    static const double floating_point_number = 22708089.862725008;
+    char tmp_buf[1024];
+    for (int i = 0; i < 1000; ++i)
+        sprintf(tmp_buf, "%d%f\n", integer_number * i * i, floating_point_number * i * i);
+    printf("overthrower have to print useless string to force printf to do all preallocations: %s", tmp_buf);
+#endif
+
+    g_malloc_counter = 0;
+#if defined(PLATFORM_OS_LINUX)
+    if (g_knowledge_base.build())
+        g_call_site_cache.invalidate();
+#endif
+    g_call_site_cache.resetStatistics();
+    resetStats();
+    resetTimingHistograms();
+    g_untracked_blocks = 0;
+    g_random_pool_size = 0; // An activation, e.g. of a forked child, never reuses random values of a previous one.
+
+    g_quiet = isQuietModeRequested();
+    announce("overthrower got activation signal.\n");
+    announce("overthrower will use following parameters for failing allocations:\n");
+    g_strategy = g_strategy_callback.callback ? static_cast<unsigned int>(STRATEGY_CALLBACK) : readValFromEnvVar("OVERTHROWER_STRATEGY", STRATEGY_RANDOM, STRATEGY_SCHEDULE, STRATEGY_PULSE);
+    announce("Strategy = %s\n", g_strategy_names[g_strategy]);
+    if (g_strategy == STRATEGY_RANDOM) {
+        g_seed = readValFromEnvVar("OVERTHROWER_SEED", 0, UINT_MAX);
+        g_duty_cycle = readValFromEnvVar("OVERTHROWER_DUTY_CYCLE", MIN_DUTY_CYCLE, MAX_DUTY_CYCLE);
+        announce("Duty cycle = %u\n", g_duty_cycle);
+        announce("Seed = %u\n", g_seed);
+    }
+    else if (g_strategy == STRATEGY_STEP || g_strategy == STRATEGY_PULSE) {
+        g_delay = readValFromEnvVar("OVERTHROWER_DELAY", MIN_DELAY, MAX_DELAY, MAX_RANDOM_DELAY);
+        announce("Delay = %u\n", g_delay);
+        if (g_strategy == STRATEGY_PULSE) {
+            g_duration = readValFromEnvVar("OVERTHROWER_DURATION", MIN_DURATION, MAX_DURATION);
+            announce("Duration = %u\n", g_duration);
+        }
+    }
+    else if (g_strategy == STRATEGY_SITE) {
+        loadExercisedSites();
+    }
+    else if (g_strategy == STRATEGY_SCHEDULE) {
+        loadSchedule();
+    }
+
+    g_random_thread_ordinal = 0;
+    g_random_generation.fetch_add(1U, std::memory_order_release);
+
+    const char* report_file = getenv("OVERTHROWER_REPORT_FILE");
+    if (report_file && *report_file && g_report_fd == STDERR_FILENO) {
+        const int fd = open(report_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0)
+            fprintf(stderr, "OVERTHROWER_REPORT_FILE (%s) can not be opened. Using stderr instead.\n", report_file);
+        else
+            g_report_fd = fd;
+    }
+    announce("Report file = %s\n", g_report_fd == STDERR_FILENO ? "stderr" : report_file);
+
+    g_self_overthrow = getenv("OVERTHROWER_SELF_OVERTHROW") != nullptr;
+    announce("Self overthrow mode = %s\n", g_self_overthrow ? "enabled" : "disabled");
+
+    g_verbose_mode = readValFromEnvVar("OVERTHROWER_VERBOSE", VERBOSE_NO, VERBOSE_ALL_ALLOCATIONS, 0U, VERBOSE_NO);
+    announce("Verbose mode = %u\n", g_verbose_mode);
+
+    g_deferred_traces = g_verbose_mode != VERBOSE_NO && readValFromEnvVar("OVERTHROWER_DEFERRED_TRACES", 0U, 1U, 0U, 0U) != 0;
+    announce("Deferred traces = %s\n", g_deferred_traces ? "enabled" : "disabled");
+
+    g_leak_sites = readValFromEnvVar("OVERTHROWER_LEAK_SITES", 0U, 1U, 0U, 0U) != 0;
+    announce("Leak sites mode = %s\n", g_leak_sites ? "enabled" : "disabled");
+
+    g_reclaim_leaks = readValFromEnvVar("OVERTHROWER_RECLAIM_LEAKS", 0U, 1U, 0U, 0U) != 0;
+    announce("Reclaim leaks mode = %s\n", g_reclaim_leaks ? "enabled" : "disabled");
+
+    g_sample_rate = readValFromEnvVar("OVERTHROWER_SAMPLE_RATE", 0U, MAX_SAMPLE_RATE, 0U, 0U);
+    announce("Sample rate = %u\n", g_sample_rate);
+
+    g_timing_period = readValFromEnvVar("OVERTHROWER_TIMING", 0U, MAX_TIMING_PERIOD, 0U, 0U);
+    announce("Timing period = %u\n", g_timing_period);
+
+    g_fork_policy = readValFromEnvVar("OVERTHROWER_FORK_POLICY", FORK_INHERIT, FORK_DORMANT, 0U, FORK_INHERIT);
+    announce("Fork policy = %s\n", g_fork_policy_names[g_fork_policy]);
+    installForkHandlers();
+
+    g_sequence_mode = readValFromEnvVar("OVERTHROWER_SEQUENCE", SEQUENCE_GLOBAL, SEQUENCE_THREAD, 0U, SEQUENCE_GLOBAL);
+    announce("Sequence = %s\n", g_sequence_names[g_sequence_mode]);
+    if (g_strategy == STRATEGY_RANDOM && g_verbose_mode >= VERBOSE_FAILED_ALLOCATIONS)
+        openScheduleRecord();
+
+    const unsigned int snapshot_signal = readValFromEnvVar("OVERTHROWER_SNAPSHOT_SIGNAL", 0U, NSIG - 1U, 0U, 0U);
+    announce("Snapshot signal = %u\n", snapshot_signal);
+
+    const unsigned int exploration_limit = g_exploration_fd < 0 ? readValFromEnvVar("OVERTHROWER_EXPLORE", 0U, MAX_DELAY, 0U, 0U) : 0U;
+    if (exploration_limit) {
+        const long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+        const unsigned int default_job_count = cpu_count > 0 ? static_cast<unsigned int>(std::min<long>(cpu_count, MAX_EXPLORATION_JOBS)) : 1U;
+        const unsigned int job_count = readValFromEnvVar("OVERTHROWER_EXPLORE_JOBS", 1U, MAX_EXPLORATION_JOBS, 0U, default_job_count);
+        announce("Exploration = up to %u allocations, %u jobs\n", exploration_limit, job_count);
+
+        if (exploreFaultSpace(exploration_limit, job_count)) {
+            // A child fails exactly one allocation, its own output is of no interest.
+            const int null_fd = open("/dev/null", O_WRONLY);
+            if (null_fd >= 0) {
+                dup2(null_fd, STDOUT_FILENO);
+                dup2(null_fd, STDERR_FILENO);
+                close(null_fd);
+            }
+            if (g_report_fd != STDERR_FILENO) {
+                close(g_report_fd);
+                g_report_fd = STDERR_FILENO;
+            }
+            g_strategy = STRATEGY_PULSE;
+            g_delay = g_exploration_seq_num;
+            g_duration = 1;
+            g_self_overthrow = false;
+            g_verbose_mode = VERBOSE_NO;
+            g_deferred_traces = false;
+            g_leak_sites = false;
+            g_sequence_mode = SEQUENCE_GLOBAL; // A child tells whether allocation k has been reached using the global counter.
+            g_sample_rate = 0;                 // Allocations are numbered the same way as by the parent, not only sampled ones.
+        }
+    }
+
+    // Children of fault space exploration never write snapshots, they would overwrite ones of the parent.
+    if (snapshot_signal && g_exploration_fd < 0)
+        startSnapshotThread(static_cast<int>(snapshot_signal));
+
+    if (g_deferred_traces)
+        startTraceThread();
+
+#if defined(PLATFORM_OS_LINUX)
+    g_target_scope.build();
+    if (g_target_scope.isEnabled())
+        announce("Target library = %s (%u code segment(s) loaded)\n", g_target_scope.target(), g_target_scope.targetRangeCount());
+    g_scoped = g_thread_scoped || g_target_scope.isEnabled();
+#else
+    g_scoped = g_thread_scoped;
+#endif
+    announce("Thread scope = %s\n", g_thread_scoped ? "enabled" : "disabled");
+
+    g_malloc_hot_path = selectMallocHotPath(g_strategy, g_verbose_mode, g_self_overthrow);
+    g_activated = true;
+}
+
+// Activates overthrower for the calling thread only, other threads may join the scope by invoking this function too.
+// Threads which have not joined allocate as if overthrower was dormant, deactivateOverthrower ends the scope for all threads.
+extern "C" __attribute__((visibility("default"))) void activateOverthrowerForThisThread() noexcept
+{
+#if defined(PLATFORM_OS_MAC_OS_X)
+    if (!g_initialized)
+        initialize();
+#endif
+
+    if (!g_activated) {
+        g_thread_scoped = true;
+        activateOverthrower();
+    }
+    else if (!g_thread_scoped) {
+        fprintf(stderr, "overthrower is already activated for all threads.\n");
+        return;
+    }
+    g_state.scope_generation = g_random_generation.load(std::memory_order_acquire);
+}
+
+// Every sampled block stands for a number of blocks which have not been sampled, see sampleWeight.
+static void reportLeakEstimate() noexcept
+{
+    double blocks = 0.0;
+    double bytes = 0.0;
+    g_registry.forEach([&blocks, &bytes](const Registry::Slot& slot) {
+        const double weight = sampleWeight(slot.info.size);
+        blocks += weight;
+        bytes += weight * static_cast<double>(slot.info.size);
+    });
+
+    ReportWriter writer;
+    writer.text("overthrower has sampled allocations every ").decimal(g_sample_rate).text(" bytes on average, ");
+    writer.decimal(g_registry.size()).text(" sampled block(s) stand for about ").decimal(static_cast<unsigned long long>(std::llround(blocks)));
+    writer.text(" leaked block(s) of ").decimal(static_cast<unsigned long long>(std::llround(bytes))).text(" byte(s)\n");
+}
+
+// Leaked blocks are grouped by call sites which have allocated them, groups are sorted by total size.
+// Call sites are symbolized only here, nothing except an identifier of a call site is stored per allocation.
+static void reportLeakSites() noexcept
+{
+    struct Site {
+        unsigned int id;
+        unsigned int block_count;
+        unsigned long long byte_count;
+    };
+
+    // Site 0 collects blocks which call sites are not known, e.g. blocks allocated while the call site cache was full.
+    auto sites = static_cast<Site*>(nonFailingMalloc((CALL_SITE_CACHE_SIZE + 1U) * sizeof(Site)));
+    if (!sites) {
+        fprintf(stderr, "overthrower is unable to group leaked blocks by call sites (out of memory).\n");
+        return;
+    }
+    for (unsigned int i = 0; i <= CALL_SITE_CACHE_SIZE; ++i)
+        sites[i] = Site{ i, 0U, 0U };
+
+    g_registry.forEach([sites](const Registry::Slot& slot) {
+        Site& site = sites[slot.info.site <= CALL_SITE_CACHE_SIZE ? slot.info.site : 0U];
+        ++site.block_count;
+        site.byte_count += slot.info.size;
+    });
+
+    Site* const sites_end = std::remove_if(sites, sites + CALL_SITE_CACHE_SIZE + 1U, [](const Site& site) { return !site.block_count; });
+    std::sort(sites, sites_end, [](const Site& a, const Site& b) { return a.byte_count > b.byte_count || (a.byte_count == b.byte_count && a.id < b.id); });
+
+    ReportWriter writer;
+    writer.text("overthrower has detected not freed memory blocks allocated at following call sites:\n");
+    for (const Site* site = sites; site != sites_end; ++site) {
+        writer.text("\n### ").decimal(site->block_count).text(site->block_count == 1 ? " block, " : " blocks, ");
+        writer.decimal(site->byte_count).text(site->byte_count == 1 ? " byte ###\n" : " bytes ###\n");
+
+        uintptr_t ips[CALL_SITE_DEPTH];
+        const unsigned int count = g_call_site_cache.callChain(site->id, ips);
+        if (!count)
+            writer.text("unknown call site\n");
+        for (unsigned int depth = 0; depth < count; ++depth) {
+            const FrameSymbol symbol = symbolizeReturnAddress(ips[depth]);
+            writer.text("#").decimal(depth, 2, true).text(" 0x").hex(ips[depth], 16);
+            writer.text(" ").text(symbol.file_name).text(" - ").text(symbol.func_name).text(" + 0x").hex(symbol.offset).text("\n");
+            free(symbol.demangled_name);
+        }
+    }
+
+    writer.text("^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^\n");
+    writer.flush();
+    nonFailingFree(sites);
+}
+
+// Leaked blocks are released in bulk, so repeated activations in a long living process do not keep growing its memory footprint.
+// A block which the program frees later would be freed twice, so only blocks which are never freed by the program may be reclaimed.
+static void reclaimLeakedBlocks() noexcept
+{
+    unsigned int block_count = 0;
+    unsigned long long byte_count = 0;
+    g_registry.forEach([&block_count, &byte_count](const Registry::Slot& slot) {
+        ++block_count;
+        byte_count += slot.info.size;
+        native_free(slot.pointer);
+    });
+    announce("overthrower has reclaimed %u leaked block(s), %llu byte(s).\n", block_count, byte_count);
+}
+
+extern "C" __attribute__((visibility("default"))) unsigned int deactivateOverthrower() noexcept
+{
+    g_self_overthrow = false;
+    g_activated = false;
+    g_scoped = false;
+    g_thread_scoped = false;
+    StatsSlot* const stats = g_state.stats; // A slot belongs to a thread for its whole life.
+    g_state = {};
+    g_state.stats = stats;
+
+    announce("overthrower got deactivation signal.\n");
+    announce("overthrower will not fail allocations anymore.\n");
+    stopSnapshotThread();
+    if (g_deferred_traces)
+        stopTraceThread();
+
+    const auto blocks_leaked = static_cast<unsigned int>(g_registry.size());
+
+    if (g_exploration_fd >= 0) {
+        // A child of fault space exploration reports its outcome and ends, the rest of the program is of no interest.
+        const ExplorationRecord record{ g_exploration_seq_num, blocks_leaked, g_malloc_counter > g_exploration_seq_num };
+        const ssize_t written = write(g_exploration_fd, &record, sizeof(record));
+        _exit(written == static_cast<ssize_t>(sizeof(record)) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    if (blocks_leaked && g_leak_sites) {
+        reportLeakSites();
+    }
+    else if (blocks_leaked) {
+        ReportWriter writer;
+        writer.text("overthrower has detected not freed memory blocks with following addresses:\n");
+        g_registry.forEach([&writer](const Registry::Slot& slot) {
+            writer.text("0x").hex(reinterpret_cast<uintptr_t>(slot.pointer), 16).text("  -  ");
+            writer.decimal(slot.info.seq_num, 6).text("  -  ").decimal(slot.info.size, 10).text("\n");
+        });
+
+        writer.text("^^^^^^^^^^^^^^^^^^  |  ^^^^^^  |  ^^^^^^^^^^\n");
+        writer.text("      pointer       |  malloc  |  block size\n");
+        writer.text("                    |invocation|\n");
+        writer.text("                    |  number  |\n");
+        writer.flush();
+    }
+
+    if (blocks_leaked && g_sample_rate)
+        reportLeakEstimate();
+
+    if (blocks_leaked) {
+        if (g_reclaim_leaks)
+            reclaimLeakedBlocks();
+        g_registry.clear(); // Tables are dropped as a whole, nothing is done per block.
+    }
+
+    const uint64_t blocks_untracked = g_untracked_blocks.load(std::memory_order_relaxed);
+    if (blocks_untracked) {
+        ReportWriter writer;
+        writer.text("overthrower has lost track of ").decimal(blocks_untracked).text(" reallocated block(s), the registry was unable to grow.\n");
+    }
+
+    if (g_timing_period) {
+        reportTimingHistograms();
+        g_timing_period = 0;
+    }
+
+    if (g_report_fd != STDERR_FILENO) {
+        close(g_report_fd);
+        g_report_fd = STDERR_FILENO;
+    }
+    closeExercisedSites();
+    closeScheduleRecord();
+
+    return blocks_leaked;
+}
+
+extern "C" __attribute__((visibility("default"))) void pauseOverthrower(unsigned int duration) noexcept
+{
+#if defined(PLATFORM_OS_MAC_OS_X)
+    if (!g_initialized)
+        initialize();
+#endif
+
+    g_state.pauses.push(duration == 0 ? UINT_MAX : duration);
+}
+
+// Unbalanced invocations are ignored, nothing is printed from here since allocation functions may be on the stack.
+extern "C" __attribute__((visibility("default"))) void resumeOverthrower() noexcept
+{
+    g_state.pauses.pop();
+}
+
+// xorshift64* generator which lives in thread local storage, there is neither a lock nor a sequence shared between threads.
+// Every thread is seeded from OVERTHROWER_SEED and the order in which threads have started using the generator after activation,
+// so for a given seed a sequence of failures of each thread is reproducible.
+// splitmix64 spreads close seeds (and thread ordinals) far apart, also xorshift must never be seeded with 0.
+static uint64_t seedXorshift(uint64_t seed) noexcept
+{
+    seed += 0x9E3779B97F4A7C15ULL;
+    seed = (seed ^ (seed >> 30U)) * 0xBF58476D1CE4E5B9ULL;
+    seed = (seed ^ (seed >> 27U)) * 0x94D049BB133111EBULL;
+    seed ^= seed >> 31U;
+    return seed ? seed : 1U;
+}
+
+static uint64_t nextXorshift(uint64_t& state) noexcept
+{
+    uint64_t value = state;
+    value ^= value >> 12U;
+    value ^= value << 25U;
+    value ^= value >> 27U;
+    state = value;
+    return value * 0x2545F4914F6CDD1DULL;
+}
+
+static uint32_t generateThreadRandomValue() noexcept
+{
+    State& state = g_state;
+    const unsigned int generation = g_random_generation.load(std::memory_order_acquire);
+    if (state.random_generation != generation) {
+        state.random_generation = generation;
+        state.random_state = seedXorshift(static_cast<uint64_t>(g_seed) << 32U | g_random_thread_ordinal++);
+    }
+    return static_cast<uint32_t>(nextXorshift(state.random_state) >> 32U);
+}
+
+// Sampling of allocations (OVERTHROWER_SAMPLE_RATE=N) works like the one of tcmalloc: intervals between sampled allocations are measured in bytes
+// and drawn from an exponential distribution with a mean of N bytes, so every allocated byte has the same chance to be sampled
+// and big blocks are sampled almost always. Only sampled allocations are inspected, tracked and may be failed.
+static size_t nextSampleInterval(State& state) noexcept
+{
+    // A uniform value of (0; 1], logarithm of 0 is not defined.
+    const double uniform = static_cast<double>((nextXorshift(state.sample_state) >> 11U) + 1U) / 9007199254740992.0; // 2^53
+    const double interval = -std::log(uniform) * g_sample_rate;
+    return interval < 1.0 ? 1U : interval > static_cast<double>(MAX_SAMPLE_RATE) * 64.0 ? static_cast<size_t>(MAX_SAMPLE_RATE) * 64U
+                                                                                         : static_cast<size_t>(interval);
+}
+
+// An allocation is sampled if a sampling point falls within its bytes, the next interval starts right after a sampled allocation.
+__attribute__((noinline)) static bool drawSample(size_t size) noexcept
+{
+    State& state = g_state;
+    const unsigned int generation = g_random_generation.load(std::memory_order_acquire);
+    if (state.sample_generation != generation) {
+        // Sequences of neighbouring threads must not be the same, the address of thread local storage tells threads apart.
+        state.sample_generation = generation;
+        state.sample_state = seedXorshift(reinterpret_cast<uintptr_t>(&state) ^ static_cast<uint64_t>(generation) << 48U);
+        state.sample_bytes_left = nextSampleInterval(state);
+        if (state.sample_bytes_left > size) {
+            state.sample_bytes_left -= size;
+            return false;
+        }
+    }
+
+    state.sample_bytes_left = nextSampleInterval(state);
+    return true;
+}
+
+__attribute__((always_inline)) static inline bool isSampledAllocation(size_t size) noexcept
+{
+    State& state = g_state;
+    if (state.sample_bytes_left > size && state.sample_generation == g_random_generation.load(std::memory_order_relaxed)) {
+        state.sample_bytes_left -= size;
+        return false;
+    }
+    return drawSample(size);
+}
+
+static unsigned int nextSeqNum() noexcept
+{
+    if (g_sequence_mode == SEQUENCE_GLOBAL)
+        return g_malloc_counter.fetch_add(1U, std::memory_order_relaxed);
+
+    State& state = g_state;
+    const unsigned int generation = g_random_generation.load(std::memory_order_acquire);
+    if (state.sequence_generation != generation) {
+        state.sequence_generation = generation;
+        state.seq_num = 0;
+        state.seq_end = 0;
+    }
+    if (g_sequence_mode == SEQUENCE_BATCHED && state.seq_num == state.seq_end) {
+        // The only shared write, once per SEQUENCE_BATCH_SIZE allocations of a thread.
+        state.seq_num = g_malloc_counter.fetch_add(SEQUENCE_BATCH_SIZE, std::memory_order_relaxed);
+        state.seq_end = state.seq_num + SEQUENCE_BATCH_SIZE;
+    }
+    return state.seq_num++;
+}
+
+// Configuration of the decision pipeline which is known at compile time.
+// Hot paths are instantiated for every possible configuration, so each of them pays only for its own strategy and modes.
+template<unsigned int Strategy, unsigned int VerboseMode, bool SelfOverthrow>
+struct StaticConfiguration {
+    static constexpr unsigned int strategy() noexcept { return Strategy; }
+    static constexpr unsigned int verboseMode() noexcept { return VerboseMode; }
+    static constexpr bool selfOverthrow() noexcept { return SelfOverthrow; }
+};
+
+// Configuration which is read at run time, used by allocation functions which are not that hot.
+struct RuntimeConfiguration {
+    static unsigned int strategy() noexcept { return g_strategy; }
+    static unsigned int verboseMode() noexcept { return g_verbose_mode; }
+    static bool selfOverthrow() noexcept { return g_self_overthrow; }
+};
+
+// Allocations done by a user defined strategy itself are neither failed nor tracked.
+__attribute__((noinline)) static bool invokeStrategyCallback(unsigned int malloc_seq_num, size_t size, unsigned int site) noexcept
+{
+    g_state.is_tracing = true;
+    const unsigned long thread_id = static_cast<unsigned long>(reinterpret_cast<uintptr_t>(pthread_self()));
+    const bool result = g_strategy_callback.callback(malloc_seq_num, size, thread_id, site, g_strategy_callback.user_data) != 0;
+    g_state.is_tracing = false;
+    return result;
+}
+
+// A new strategy needs nothing but a new case here and a new entry in selectMallocHotPath.
+template<typename Configuration>
+__attribute__((always_inline)) static inline bool isTimeToFail(unsigned int malloc_seq_num, size_t size, unsigned int site) noexcept
+{
+    switch (Configuration::strategy()) {
+        case STRATEGY_RANDOM:
+            return generateThreadRandomValue() % g_duty_cycle == 0;
+        case STRATEGY_STEP:
+            return malloc_seq_num >= g_delay;
+        case STRATEGY_PULSE:
+            return malloc_seq_num >= g_delay && malloc_seq_num < g_delay + g_duration;
+        case STRATEGY_SITE:
+            return g_site_states[site].load(std::memory_order_relaxed) == SITE_STATE_EXERCISED ? false : isFirstAllocationFromSite(site);
+        case STRATEGY_SCHEDULE:
+            return isScheduledAllocation(malloc_seq_num);
+        case STRATEGY_CALLBACK:
+            return invokeStrategyCallback(malloc_seq_num, size, site);
+        case STRATEGY_NONE:
+        default: // Just to make static code analyzers fully happy.
+            return false;
+    }
+}
+
+template<typename Configuration>
+__attribute__((always_inline)) static inline void* nonFailingMalloc(size_t size) noexcept
+{
+    if (Configuration::selfOverthrow() && (generateThreadRandomValue() % 2U) == 0) {
+        // By doing this we emulate real OOM conditions where native malloc can really return nullptr.
+        // This may happen if tests are run on a system which is running out of resources.
+        return nullptr;
+    }
+
+    return native_malloc(size);
+}
+
+void* nonFailingMalloc(size_t size) noexcept
+{
+    return nonFailingMalloc<RuntimeConfiguration>(size);
+}
+
+void nonFailingFree(void* pointer) noexcept
+{
+    native_free(pointer);
+}
+
+// Anonymous mappings are zeroed and page aligned, sizes are rounded up to whole pages by the kernel.
+void* nonFailingMap(size_t size) noexcept
+{
+    if (g_self_overthrow && (generateThreadRandomValue() % 2U) == 0)
+        return nullptr; // Same emulation of real OOM conditions as in nonFailingMalloc.
+
+    void* pointer = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    return pointer == MAP_FAILED ? nullptr : pointer;
+}
+
+void nonFailingUnmap(void* pointer, size_t size) noexcept
+{
+    if (pointer)
+        munmap(pointer, size);
+}
+
+// returns is_in_white_list, is_in_ignore_list pair.
+typedef std::pair<bool, bool> (
+    *BacktraceCallback)(unsigned int depth, uintptr_t ip, uintptr_t sp, const char* library_name, const char* func_name, uintptr_t off);
+
+#if defined(WITH_LIBUNWIND) || defined(WITH_FAST_UNWIND)
+// ip - instruction pointer
+// sp - stack pointer (not known when WITH_FAST_UNWIND is used)
+static std::pair<bool, bool> printFrameInfo(unsigned int depth,
+                                            uintptr_t ip,
+                                            uintptr_t sp,
+                                            const char* library_name,
+                                            const char* func_name,
+                                            uintptr_t off) noexcept
+{
+    g_state.trace->text("#").decimal(depth, 2, true).text(" 0x").hex(ip, 16).text(" sp=0x").hex(sp, 16);
+    g_state.trace->text(" ").text(library_name).text(" - ").text(func_name).text(" + 0x").hex(off).text("\n");
+#else
+static std::pair<bool, bool> printFrameInfo(unsigned int depth, uintptr_t, uintptr_t, const char*, const char* func_name, uintptr_t)
+{
+    // Only function name is known, nothing else.
+    g_state.trace->text("#").decimal(depth, 2, true).text(" ").text(func_name).text("\n");
+#endif
+    return std::make_pair(false, false);
+}
+
+#if defined(WITH_FAST_UNWIND)
+struct UnwindState {
+    uintptr_t* ips;
+    unsigned int count;
+    unsigned int max_count;
+};
+
+static _Unwind_Reason_Code unwindCallback(struct _Unwind_Context* context, void* arg) noexcept
+{
+    auto state = static_cast<UnwindState*>(arg);
+    if (state->count == state->max_count)
+        return _URC_END_OF_STACK;
+    const uintptr_t ip = _Unwind_GetIP(context);
+    if (!ip)
+        return _URC_END_OF_STACK;
+    state->ips[state->count++] = ip;
+    return _URC_NO_REASON;
+}
+
+// Collects raw return addresses only, the first one belongs to the caller, exactly as with backtrace.
+// Has to be inlined, otherwise the depth of all frames would be shifted by one.
+__attribute__((always_inline)) static inline unsigned int unwindStack(uintptr_t* ips, unsigned int max_count) noexcept
+{
+    UnwindState state{ ips, 0U, max_count };
+    _Unwind_Backtrace(unwindCallback, &state);
+    return state.count;
+}
+#endif
+
+// is_real_oom (if provided) is set when the stack could not be inspected, (true, true) is returned in this case.
+__attribute__((noinline)) static std::pair<bool, bool> traverseStack(BacktraceCallback callback, bool* is_real_oom = nullptr) noexcept
+{
+#if defined(WITH_LIBUNWIND)
+    unw_cursor_t cursor;
+    unw_context_t context;
+    Dl_info dl_info;
 
     unw_getcontext(&context);
     unw_init_local(&cursor, &context);
@@ -452,7 +3520,7 @@ __attribute__((noinline)) static std::pair<bool, bool> traverseStack(BacktraceCa
             continue;
         }
 
-        if (g_verbose_mode == VERBOSE_NO && i >= MAX_STACK_DEPTH) {
+        if (callback != printFrameInfo && i >= MAX_STACK_DEPTH) {
             // No need to go deeper.
             break;
         }
@@ -483,6 +3551,8 @@ __attribute__((noinline)) static std::pair<bool, bool> traverseStack(BacktraceCa
             }
         }
         else {
+            if (is_real_oom)
+                *is_real_oom = true;
             return std::make_pair(true, true); // Real OOM.
         }
 
@@ -501,187 +3571,490 @@ __attribute__((noinline)) static std::pair<bool, bool> traverseStack(BacktraceCa
             return check_status;
     }
 
-    return std::make_pair(false, false);
-#else
-    void* callstack[MAX_STACK_DEPTH_VERBOSE];
-    const int count = backtrace(callstack, callback == printFrameInfo ? MAX_STACK_DEPTH_VERBOSE : MAX_STACK_DEPTH);
-    char** symbols = backtrace_symbols(callstack, count);
+    return std::make_pair(false, false);
+#elif defined(WITH_FAST_UNWIND)
+    (void)is_real_oom; // This backend inspects the stack without allocating, so it never gives up.
+    uintptr_t callstack[MAX_STACK_DEPTH_VERBOSE];
+    const unsigned int count = unwindStack(callstack, callback == printFrameInfo ? MAX_STACK_DEPTH_VERBOSE : MAX_STACK_DEPTH);
+
+    // Names are resolved using dynamic symbol tables only, nothing is allocated unless a name needs to be demangled for printing.
+    for (unsigned int depth = 1; depth < count; ++depth) {
+        const uintptr_t ip = callstack[depth];
+        const char* file_name = "???";
+        const char* func_name = "???";
+        char* demangled_name = nullptr;
+        uintptr_t off = 0;
+        Dl_info dl_info;
+
+        // A return address may point right past the end of a function which never returns, ip - 1 is always inside the caller.
+        if (dladdr(reinterpret_cast<void*>(ip - 1U), &dl_info)) {
+            if (dl_info.dli_fname && *dl_info.dli_fname)
+                file_name = dl_info.dli_fname;
+            if (dl_info.dli_sname) {
+                func_name = dl_info.dli_sname;
+                off = ip - reinterpret_cast<uintptr_t>(dl_info.dli_saddr);
+                if (callback == printFrameInfo) {
+                    int status;
+                    demangled_name = abi::__cxa_demangle(func_name, nullptr, nullptr, &status);
+                    if (status == 0)
+                        func_name = demangled_name;
+                }
+            }
+        }
+
+        const auto check_status = callback(depth, ip, 0U, file_name, func_name, off);
+
+        free(demangled_name);
+
+        if (check_status.first || check_status.second)
+            return check_status;
+    }
+
+    return std::make_pair(false, false);
+#else
+    void* callstack[MAX_STACK_DEPTH_VERBOSE];
+    const int count = backtrace(callstack, callback == printFrameInfo ? MAX_STACK_DEPTH_VERBOSE : MAX_STACK_DEPTH);
+    char** symbols = backtrace_symbols(callstack, count);
+
+    if (!symbols) {
+        // Real OOM
+        if (is_real_oom)
+            *is_real_oom = true;
+        return std::make_pair(true, true);
+    }
+
+    for (unsigned int depth = 1; depth < count; ++depth) {
+        const auto check_status = callback(depth, 0U, 0U, nullptr, symbols[depth], 0U);
+        if (check_status.first || check_status.second) {
+            free(symbols);
+            return check_status;
+        }
+    }
+
+    free(symbols);
+
+    return std::make_pair(false, false);
+#endif
+}
+
+#if defined(PLATFORM_OS_MAC_OS_X)
+__attribute__((noinline)) static std::pair<bool, bool> checker(unsigned int depth, uintptr_t, uintptr_t, const char*, const char* func_name, uintptr_t) noexcept
+{
+    // malloc invokes its hot path through a pointer, optimizing compilers turn this call into a jump, so depths may be shifted by one.
+    if (depth >= 3 && depth <= 5 && strstr(func_name, "__cxa_allocate_exception")) {
+        // This branch is reachable with macOS 10.14 / Xcode 10 and older.
+        // In newer environments some other mechanism seems to be used for allocating exception objects.
+        return std::make_pair(true, false);
+    }
+
+    // __cxa_atexit is not supposed to be used explicitly but overthrower needs to be aware of existence of this function:
+    // Allocations which come from __cxa_atexit shall not be failed by overthrower.
+    // Memory which is allocated by __cxa_atexit shall not be treated as memory leak.
+    if (depth >= 3 && depth <= 5 && strstr(func_name, "__cxa_atexit")) {
+        return std::make_pair(true, true);
+    }
+
+    return std::make_pair(false, false);
+}
+#endif
+
+__attribute__((noinline)) static unsigned int captureStack(uintptr_t* ips, unsigned int max_count) noexcept
+{
+#if defined(WITH_LIBUNWIND)
+    const int count = unw_backtrace(reinterpret_cast<void**>(ips), static_cast<int>(max_count));
+#elif defined(WITH_FAST_UNWIND)
+    const int count = static_cast<int>(unwindStack(ips, max_count));
+#else
+    const int count = backtrace(reinterpret_cast<void**>(ips), static_cast<int>(max_count));
+#endif
+    return count > 0 ? static_cast<unsigned int>(count) : 0U;
+}
+
+// Counters describe the current (or the last) activation, live blocks after deactivation are the leaked ones.
+extern "C" __attribute__((visibility("default"))) void getOverthrowerStats(OverthrowerStats* stats) noexcept
+{
+    if (!stats)
+        return;
+
+    uint64_t totals[STAT_COUNT] = {};
+    const unsigned int slot_count = std::min(g_stats_slot_count.load(std::memory_order_relaxed), STATS_SLOT_COUNT);
+    for (unsigned int i = 0; i < slot_count; ++i) {
+        for (unsigned int counter = 0; counter < STAT_COUNT; ++counter)
+            totals[counter] += g_stats_slots[i].counters[counter].load(std::memory_order_relaxed);
+    }
+
+    stats->allocations = totals[STAT_ALLOCATIONS];
+    stats->failed = totals[STAT_FAILED];
+    stats->whitelisted = totals[STAT_WHITELISTED];
+    stats->ignored = totals[STAT_IGNORED];
+    stats->paused = totals[STAT_PAUSED];
+    stats->live_blocks = totals[STAT_LIVE_BLOCKS];
+    stats->live_bytes = totals[STAT_LIVE_BYTES];
+    stats->peak_live_bytes = std::max(static_cast<uint64_t>(g_peak_live_bytes.load(std::memory_order_relaxed)), totals[STAT_LIVE_BYTES]);
+    for (unsigned int i = 0; i < STATS_SIZE_CLASS_COUNT; ++i)
+        stats->size_classes[i] = totals[STAT_SIZE_CLASS + i];
+    stats->unsampled = totals[STAT_UNSAMPLED];
+}
+
+extern "C" __attribute__((visibility("default"))) void getOverthrowerCacheStats(unsigned long long* hits, unsigned long long* misses) noexcept
+{
+    if (hits)
+        *hits = g_call_site_cache.hits();
+    if (misses)
+        *misses = g_call_site_cache.misses();
+}
+
+// overthrower internal logic requires call stack depth to be deterministic,
+// function "checker" (which is implemented above) will not work correctly if this requirement is not satisfied.
+// Compilers may decide that the function "searchKnowledgeBase" is way too simple and inline it,
+// this will break expectations and prevent overthrower from working correctly.
+// In order to prevent compilers from inlining "searchKnowledgeBase" we use "__attribute__((noinline))".
+__attribute__((noinline)) static void searchKnowledgeBase(bool& is_in_white_list, bool& is_in_ignore_list, unsigned int& site) noexcept
+{
+    uintptr_t ips[CALL_SITE_CAPTURE_DEPTH];
+    unsigned int count = captureStack(ips, CALL_SITE_CAPTURE_DEPTH);
+
+#if defined(PLATFORM_OS_LINUX)
+    // Frames of overthrower itself are of no interest, the first remaining one belongs to the caller of an allocation function.
+    unsigned int first = 0;
+    while (first < count && g_knowledge_base.isOwnFrame(ips[first]))
+        ++first;
+    const uintptr_t* call_chain = ips + first;
+    count = std::min(count - first, CALL_SITE_DEPTH);
+
+    if (count && (site = g_call_site_cache.lookup(call_chain, count, is_in_white_list, is_in_ignore_list)))
+        return;
+
+    g_knowledge_base.refresh(call_chain, count);
+    const auto check_result = g_knowledge_base.check(call_chain, count);
+    is_in_white_list = check_result.first;
+    is_in_ignore_list = check_result.second;
+
+    if (count)
+        site = g_call_site_cache.store(call_chain, count, is_in_white_list, is_in_ignore_list);
+#elif defined(PLATFORM_OS_MAC_OS_X)
+    count = std::min(count, CALL_SITE_DEPTH);
+
+    if (count && (site = g_call_site_cache.lookup(ips, count, is_in_white_list, is_in_ignore_list)))
+        return;
+
+    bool is_real_oom = false;
+    const auto check_result = traverseStack(checker, &is_real_oom);
+    is_in_white_list = check_result.first;
+    is_in_ignore_list = check_result.second;
+
+    // A stack which could not be inspected (real OOM) does not say anything about the call site.
+    if (count && !is_real_oom)
+        site = g_call_site_cache.store(ips, count, is_in_white_list, is_in_ignore_list);
+#endif
+}
+
+enum AllocationVerdict {
+    ALLOCATION_FAIL,      // Allocation must be failed.
+    ALLOCATION_UNTRACKED, // Allocation must succeed, resulting block is not registered.
+    ALLOCATION_TRACKED,   // Allocation must succeed, resulting block is registered.
+};
+
+static void printAllocationTrace(bool is_failed, unsigned int malloc_seq_num) noexcept
+{
+    // Allocations done while a call stack is printed are never failed, counted or tracked.
+    g_state.is_tracing = true;
+    if (g_deferred_traces) {
+        deferTrace(is_failed, malloc_seq_num);
+        g_state.is_tracing = false;
+        return;
+    }
+    ReportWriter writer;
+    writer.text("\n### ").text(is_failed ? "Failed" : "Successful").text(" allocation, sequential number: ").decimal(malloc_seq_num).text(" ###\n");
+    g_state.trace = &writer;
+    traverseStack(printFrameInfo);
+    g_state.trace = nullptr;
+    writer.flush();
+    g_state.is_tracing = false;
+}
+
+// Decision pipeline shared by all allocation functions.
+// It is always inlined, so call stacks inspected by "searchKnowledgeBase" look the same no matter which allocation function was invoked.
+template<typename Configuration>
+__attribute__((always_inline)) static inline AllocationVerdict judgeAllocation(size_t size, unsigned int& malloc_seq_num, unsigned int& site) noexcept
+{
+    countAllocation(size);
+
+    if (g_state.pauses.isPaused()) {
+        // Paused allocations are counted but never tracked, so there is no need to inspect their call stacks.
+        g_state.pauses.consume();
+        threadStats().add(STAT_PAUSED, 1U);
+        return ALLOCATION_UNTRACKED;
+    }
+
+    if (g_sample_rate && !isSampledAllocation(size)) {
+        threadStats().add(STAT_UNSAMPLED, 1U);
+        return ALLOCATION_UNTRACKED;
+    }
+
+    bool is_in_white_list = false;
+    bool is_in_ignore_list = false;
+
+    g_state.is_tracing = true;
+    searchKnowledgeBase(is_in_white_list, is_in_ignore_list, site);
+    g_state.is_tracing = false;
+
+    malloc_seq_num = nextSeqNum();
+
+    if (is_in_white_list || !size) {
+        if (is_in_white_list)
+            threadStats().add(STAT_WHITELISTED, 1U);
+        return ALLOCATION_UNTRACKED;
+    }
+
+    if (isTimeToFail<Configuration>(malloc_seq_num, size, site)) {
+        if (Configuration::verboseMode() >= VERBOSE_FAILED_ALLOCATIONS)
+            printAllocationTrace(true, malloc_seq_num);
+        if (Configuration::strategy() == STRATEGY_RANDOM && g_schedule_fd >= 0)
+            recordScheduledFailure(malloc_seq_num);
+        threadStats().add(STAT_FAILED, 1U);
+        errno = ENOMEM;
+        return ALLOCATION_FAIL;
+    }
+
+    // is_in_ignore_list is never true alone on macOS.
+    // Register all allocations which are not in the ignore list.
+    // All registered and not freed memory blocks are considered to be memory leaks.
+    if (is_in_ignore_list) {
+        threadStats().add(STAT_IGNORED, 1U);
+        return ALLOCATION_UNTRACKED;
+    }
+    return ALLOCATION_TRACKED;
+}
+
+// Common part of all allocation functions, "allocate" obtains a block from the native allocator once it is decided not to fail the allocation.
+template<typename Configuration, typename Allocate>
+__attribute__((always_inline)) static inline void* overthrowAllocation(size_t size, Allocate allocate) noexcept
+{
+    unsigned int malloc_seq_num = 0;
+    unsigned int site = 0;
+    const AllocationVerdict verdict = judgeAllocation<Configuration>(size, malloc_seq_num, site);
+
+    if (verdict == ALLOCATION_FAIL)
+        return nullptr;
+
+    void* pointer = timeNativeCall(TIMING_ALLOCATE, size, allocate);
+
+    if (!pointer)
+        recordNativeFailure(size);
+    if (!pointer || verdict == ALLOCATION_UNTRACKED)
+        return pointer; // Real OOM or a block which is not tracked
 
-    if (!symbols) {
+    if (!g_registry.insert(pointer, Info{ malloc_seq_num, site, size })) {
         // Real OOM
-        return std::make_pair(true, true);
+        nonFailingFree(pointer);
+        errno = ENOMEM;
+        return nullptr;
     }
+    if (Configuration::verboseMode() >= VERBOSE_ALL_ALLOCATIONS)
+        printAllocationTrace(false, malloc_seq_num);
 
-    for (unsigned int depth = 1; depth < count; ++depth) {
-        const auto check_status = callback(depth, 0U, 0U, nullptr, symbols[depth], 0U);
-        if (check_status.first || check_status.second) {
-            free(symbols);
-            return check_status;
-        }
-    }
+    return pointer;
+}
 
-    free(symbols);
+template<typename Configuration>
+__attribute__((noinline)) static void* mallocHotPath(size_t size) noexcept
+{
+    return overthrowAllocation<Configuration>(size, [size]() { return nonFailingMalloc<Configuration>(size); });
+}
 
-    return std::make_pair(false, false);
-#endif
+template<unsigned int Strategy, unsigned int VerboseMode>
+static Malloc selectMallocHotPath(bool self_overthrow) noexcept
+{
+    return self_overthrow ? mallocHotPath<StaticConfiguration<Strategy, VerboseMode, true>> : mallocHotPath<StaticConfiguration<Strategy, VerboseMode, false>>;
 }
 
-#if defined(PLATFORM_OS_MAC_OS_X)
-__attribute__((noinline)) static std::pair<bool, bool> checker(unsigned int depth, uintptr_t, uintptr_t, const char*, const char* func_name, uintptr_t) noexcept
+template<unsigned int Strategy>
+static Malloc selectMallocHotPath(unsigned int verbose_mode, bool self_overthrow) noexcept
 {
-    if ((depth == 3 || depth == 4) && strstr(func_name, "__cxa_allocate_exception")) {
-        // This branch is reachable with macOS 10.14 / Xcode 10 and older.
-        // In newer environments some other mechanism seems to be used for allocating exception objects.
-        return std::make_pair(true, false);
+    switch (verbose_mode) {
+        case VERBOSE_FAILED_ALLOCATIONS:
+            return selectMallocHotPath<Strategy, VERBOSE_FAILED_ALLOCATIONS>(self_overthrow);
+        case VERBOSE_ALL_ALLOCATIONS:
+            return selectMallocHotPath<Strategy, VERBOSE_ALL_ALLOCATIONS>(self_overthrow);
+        case VERBOSE_NO:
+        default:
+            return selectMallocHotPath<Strategy, VERBOSE_NO>(self_overthrow);
     }
+}
 
-    // __cxa_atexit is not supposed to be used explicitly but overthrower needs to be aware of existence of this function:
-    // Allocations which come from __cxa_atexit shall not be failed by overthrower.
-    // Memory which is allocated by __cxa_atexit shall not be treated as memory leak.
-    if ((depth == 3 || depth == 4) && strstr(func_name, "__cxa_atexit")) {
-        return std::make_pair(true, true);
+static Malloc selectMallocHotPath(unsigned int strategy, unsigned int verbose_mode, bool self_overthrow) noexcept
+{
+    switch (strategy) {
+        case STRATEGY_RANDOM:
+            return selectMallocHotPath<STRATEGY_RANDOM>(verbose_mode, self_overthrow);
+        case STRATEGY_STEP:
+            return selectMallocHotPath<STRATEGY_STEP>(verbose_mode, self_overthrow);
+        case STRATEGY_PULSE:
+            return selectMallocHotPath<STRATEGY_PULSE>(verbose_mode, self_overthrow);
+        case STRATEGY_SITE:
+            return selectMallocHotPath<STRATEGY_SITE>(verbose_mode, self_overthrow);
+        case STRATEGY_SCHEDULE:
+            return selectMallocHotPath<STRATEGY_SCHEDULE>(verbose_mode, self_overthrow);
+        case STRATEGY_CALLBACK:
+            return selectMallocHotPath<STRATEGY_CALLBACK>(verbose_mode, self_overthrow);
+        case STRATEGY_NONE:
+        default:
+            return selectMallocHotPath<STRATEGY_NONE>(verbose_mode, self_overthrow);
     }
-
-    return std::make_pair(false, false);
 }
-#elif defined(PLATFORM_OS_LINUX)
-static std::pair<bool, bool> checker(unsigned int depth, uintptr_t, uintptr_t, const char*, const char* func_name, uintptr_t) noexcept
-{
-    static const auto compareFuncName = [](const char* a, const char* b) {
-#if defined(WITH_LIBUNWIND)
-        return strcmp(a, b) == 0;
-#else
-        return strstr(a, b) != nullptr;
+
+#if defined(PLATFORM_OS_LINUX)
+__attribute__((visibility("default")))
 #endif
-    };
+void* my_malloc(size_t size) noexcept
+{
+    // Dormant overthrower costs a single branch, thread local storage is not touched until activation.
+    if (!g_activated)
+        return native_malloc(size);
 
-    if ((depth == 2 || depth == 3) && (compareFuncName(func_name, "__cxa_allocate_exception"))) {
-        return std::make_pair(true, false);
-    }
-    if (compareFuncName(func_name, "_dl_map_object") || compareFuncName(func_name, "_dl_map_object_deps")) {
-        // These two functions tend to leak, especially in OOM conditions.
-        // https://sourceware.org/bugzilla/show_bug.cgi?id=2451
-        // https://sourceware.org/legacy-ml/libc-alpha/2013-09/msg00150.html
-        return std::make_pair(false, true);
-    }
-    if ((depth == 4 || depth == 5) && compareFuncName(func_name, "_dl_catch_exception")) {
-        return std::make_pair(false, true);
-    }
-    if (depth == 2 && (compareFuncName(func_name, "_dl_signal_error") || compareFuncName(func_name, "_dl_exception_create"))) {
-        return std::make_pair(true, true);
-    }
-    if ((depth == 4 || depth == 5) && compareFuncName(func_name, "dlerror")) {
-        return std::make_pair(false, true);
-    }
-    if (compareFuncName(func_name, "__libpthread_freeres")) {
-        // https://patches-gcc.linaro.org/patch/6525/
-        return std::make_pair(false, true);
+#if defined(PLATFORM_OS_MAC_OS_X)
+    if (g_initializing) {
+        // Thread local storage is being set up and must not be touched, not even by self overthrow mode.
+        return malloc(size);
     }
 
-    return std::make_pair(false, false);
-}
+    if (!g_initialized)
+        initialize();
 #endif
 
-// overthrower internal logic requires call stack depth to be deterministic,
-// function "checker" (which is implemented above) will not work correctly if this requirement is not satisfied.
-// Compilers may decide that the function "searchKnowledgeBase" is way too simple and inline it,
-// this will break expectations and prevent overthrower from working correctly.
-// In order to prevent compilers from inlining "searchKnowledgeBase" we use "__attribute__((noinline))".
-__attribute__((noinline)) static void searchKnowledgeBase(bool& is_in_white_list, bool& is_in_ignore_list) noexcept
-{
-    const auto check_result = traverseStack(checker);
-    is_in_white_list = check_result.first;
-    is_in_ignore_list = check_result.second;
+    if (g_state.is_tracing) {
+        // Allocations which are done by overthrower itself while it inspects a call stack are never failed, not even in self overthrow mode.
+        // Otherwise a failed stack inspection makes the allocation being inspected look like a whitelisted one.
+        return native_malloc(size);
+    }
+
+    if (g_scoped && !isInScope(__builtin_return_address(0)))
+        return native_malloc(size);
+
+    return g_malloc_hot_path(size);
 }
 
 #if defined(PLATFORM_OS_LINUX)
 __attribute__((visibility("default")))
 #endif
-void* my_malloc(size_t size) noexcept
+void* my_calloc(size_t count, size_t size) noexcept
 {
+    if (!g_activated)
+        return native_calloc(count, size);
+
 #if defined(PLATFORM_OS_MAC_OS_X)
     if (g_initializing)
-        return nonFailingMalloc(size);
-#endif
+        return calloc(count, size);
 
     if (!g_initialized)
         initialize();
+#endif
+
+    if (g_state.is_tracing || (g_scoped && !isInScope(__builtin_return_address(0))))
+        return native_calloc(count, size);
+
+    size_t total = 0;
+    if (__builtin_mul_overflow(count, size, &total)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+
+    // native_calloc is used instead of malloc + memset, fresh pages obtained from the OS are known to be zeroed already.
+    return overthrowAllocation<RuntimeConfiguration>(total, [count, size]() { return native_calloc(count, size); });
+}
 
+// Applies failure injection and tracking to allocators of aligned blocks, "allocate" is invoked only when an allocation is allowed to succeed.
+template<typename Allocate>
+__attribute__((always_inline)) static inline void* overthrowAlignedAllocation(size_t size, const void* caller, Allocate allocate) noexcept
+{
     if (!g_activated)
-        return nonFailingMalloc(size);
+        return allocate();
 
-    const unsigned int depth = g_state.depth;
-    assert(depth <= MAX_PAUSE_DEPTH);
+#if defined(PLATFORM_OS_MAC_OS_X)
+    if (g_initializing)
+        return allocate();
 
-    bool is_in_white_list = g_state.is_tracing;
-    bool is_in_ignore_list = false;
+    if (!g_initialized)
+        initialize();
+#endif
 
-    if (!g_state.is_tracing) {
-        g_state.is_tracing = true;
-        const unsigned int old_paused = g_state.paused[depth];
-        g_state.paused[depth] = UINT_MAX;
-        searchKnowledgeBase(is_in_white_list, is_in_ignore_list);
-        g_state.paused[depth] = old_paused;
-        g_state.is_tracing = false;
-    }
+    if (g_state.is_tracing || (g_scoped && !isInScope(caller)))
+        return allocate();
 
-    if (g_state.paused[depth]) {
-        --g_state.paused[depth];
-        return nonFailingMalloc(size);
-    }
+    return overthrowAllocation<RuntimeConfiguration>(size, allocate);
+}
 
-    const unsigned int malloc_seq_num = g_malloc_counter++;
+#if defined(PLATFORM_OS_LINUX)
+__attribute__((visibility("default")))
+#endif
+int my_posix_memalign(void** pointer, size_t alignment, size_t size) noexcept
+{
+    // Invalid alignment is reported as is, such invocations are neither counted nor failed.
+    if (!alignment || (alignment & (alignment - 1U)) || alignment % sizeof(void*))
+        return EINVAL;
 
-    if (is_in_white_list || !size)
-        return nonFailingMalloc(size);
+    // posix_memalign reports errors using its return value and leaves errno untouched.
+    const int old_errno = errno;
+    int result = 0;
+    void* block = overthrowAlignedAllocation(size, __builtin_return_address(0), [&result, alignment, size]() -> void* {
+        void* native_block = nullptr;
+        result = native_posix_memalign(&native_block, alignment, size);
+        return result ? nullptr : native_block;
+    });
+    errno = old_errno;
 
-    if (isTimeToFail(malloc_seq_num)) {
-        if (g_verbose_mode >= VERBOSE_FAILED_ALLOCATIONS) {
-            g_state.is_tracing = true;
-            const unsigned int old_paused = g_state.paused[depth];
-            g_state.paused[depth] = UINT_MAX;
-            fprintf(stderr, "\n### Failed allocation, sequential number: %u ###\n", malloc_seq_num);
-            traverseStack(printFrameInfo);
-            g_state.paused[depth] = old_paused;
-            g_state.is_tracing = false;
-        }
-        errno = ENOMEM;
-        return nullptr;
-    }
+    if (!block)
+        return result ? result : ENOMEM;
+    *pointer = block;
+    return 0;
+}
 
-    void* pointer = nonFailingMalloc(size);
+#if defined(PLATFORM_OS_LINUX)
+__attribute__((visibility("default")))
+#endif
+void* my_valloc(size_t size) noexcept
+{
+    return overthrowAlignedAllocation(size, __builtin_return_address(0), [size]() { return native_valloc(size); });
+}
 
-    if (!pointer) {
-        return nullptr; // Real OOM
-    }
+#if defined(PLATFORM_OS_LINUX)
+__attribute__((visibility("default"))) void* my_aligned_alloc(size_t alignment, size_t size) noexcept
+{
+    return overthrowAlignedAllocation(size, __builtin_return_address(0), [alignment, size]() { return native_aligned_alloc(alignment, size); });
+}
 
-    // is_in_ignore_list is never true alone on macOS that is why we do not use return ASAP approach at this place.
-    if (!is_in_ignore_list) {
-        // Register all allocations which are not in the ignore list.
-        // All registered and not freed memory blocks are considered to be memory leaks.
-        try {
-            std::lock_guard<std::recursive_mutex> lock(g_mutex);
-            g_allocated.emplace(pointer, Info{ malloc_seq_num, size });
-        }
-        catch (const std::bad_alloc&) {
-            // Real OOM
-            nonFailingFree(pointer);
-            errno = ENOMEM;
-            return nullptr;
-        }
-        if (g_verbose_mode >= VERBOSE_ALL_ALLOCATIONS) {
-            g_state.is_tracing = true;
-            const unsigned int old_paused = g_state.paused[depth];
-            g_state.paused[depth] = UINT_MAX;
-            fprintf(stderr, "\n### Successful allocation, sequential number: %u ###\n", malloc_seq_num);
-            traverseStack(printFrameInfo);
-            g_state.paused[depth] = old_paused;
-            g_state.is_tracing = false;
-        }
-    }
+__attribute__((visibility("default"))) void* my_memalign(size_t alignment, size_t size) noexcept
+{
+    return overthrowAlignedAllocation(size, __builtin_return_address(0), [alignment, size]() { return native_memalign(alignment, size); });
+}
 
-    return pointer;
+__attribute__((visibility("default"))) size_t my_malloc_usable_size(void* pointer) noexcept
+{
+    if (!pointer)
+        return 0;
+
+    if (isBootstrapBlock(pointer))
+        return bootstrapBlockSize(pointer);
+
+    return native_malloc_usable_size(pointer);
+}
+
+// glibc allocates blocks for exit functions using calloc from static functions which tail call each other,
+// so these allocations can not be recognized by inspecting a call stack. Registration of exit functions is intercepted instead,
+// atexit is linked statically into every executable and ends up in __cxa_atexit as well.
+// Allocations which come from __cxa_atexit shall not be failed by overthrower, C++ runtime ignores a result of __cxa_atexit
+// and destructors of static objects would be silently never invoked.
+// Memory which is allocated by __cxa_atexit shall not be treated as memory leak.
+extern "C" __attribute__((visibility("default"))) int __cxa_atexit(void (*function)(void*), void* argument, void* dso_handle) noexcept
+{
+    const bool old_is_tracing = g_state.is_tracing;
+    g_state.is_tracing = true;
+    const int result = native_cxa_atexit(function, argument, dso_handle);
+    g_state.is_tracing = old_is_tracing;
+    return result;
 }
+#endif
 
 #if defined(PLATFORM_OS_LINUX)
 __attribute__((visibility("default")))
@@ -689,51 +4062,267 @@ __attribute__((visibility("default")))
 void my_free(void* pointer) noexcept
 {
     if (!pointer) {
-        // Standard `free` is supposed to do nothing when `NULL` is tried to be freed.
-        // Invoking `native_free(NULL)` at this point may be potentially disastrous, because `native_free` can be `NULL`.
-        // `native_free` on Linux is initialized only on first `malloc` invocation.
-        // If `free(NULL)` is invoked before any allocations are done using `malloc`, `native_free` is still pointing to `NULL` and can not be invoked.
+        // Standard `free` is supposed to do nothing when `NULL` is tried to be freed, there is no need to bother the native allocator.
         return;
     }
 
+#if defined(PLATFORM_OS_LINUX)
+    if (isBootstrapBlock(pointer))
+        return;
+#endif
+
     if (g_activated) {
         const int old_errno = errno;
-        std::lock_guard<std::recursive_mutex> lock(g_mutex);
-        g_allocated.erase(pointer);
+        size_t size = TIMING_UNKNOWN_SIZE;
+        g_registry.erase(pointer, &size);
+        timeNativeCall(TIMING_FREE, size, [pointer]() {
+            native_free(pointer);
+            return true;
+        });
         errno = old_errno;
+        return;
     }
 
     native_free(pointer);
 }
 
+// The slot just freed by erasing the old entry may be taken by another thread in the meantime,
+// so insertion may have to grow a table, which fails under real OOM. A block which can not be inserted is counted instead.
+static bool trackReallocatedBlock(void* pointer, const Info& info) noexcept
+{
+    const int old_errno = errno;
+    const bool is_tracked = g_registry.insert(pointer, info);
+    if (!is_tracked)
+        g_untracked_blocks.fetch_add(1U, std::memory_order_relaxed);
+    errno = old_errno;
+    return is_tracked;
+}
+
 #if defined(PLATFORM_OS_LINUX)
 __attribute__((visibility("default")))
 #endif
 void* my_realloc(void* pointer, size_t size) noexcept
 {
+#if defined(PLATFORM_OS_MAC_OS_X)
+    if (!g_activated)
+        return native_realloc(pointer, size);
+#elif defined(PLATFORM_OS_LINUX)
+    if (!g_activated && !isBootstrapBlock(pointer))
+        return native_realloc(pointer, size);
+#endif
+
+    // my_malloc would take a call from here for a call on behalf of the caller of realloc, the scope is checked here.
+    const void* caller = __builtin_return_address(0);
     if (!pointer)
-        return my_malloc(size);
+        return !g_scoped || isInScope(caller) ? my_malloc(size) : native_malloc(size);
 
     if (!size) {
         my_free(pointer);
         return nullptr;
     }
 
-    if (!g_allocated.count(pointer))
+#if defined(PLATFORM_OS_LINUX)
+    if (isBootstrapBlock(pointer)) {
+        // Blocks of the static buffer are unknown to the native allocator, their content is moved to a regular block.
+        void* new_ptr = my_malloc(size);
+        if (new_ptr)
+            memcpy(new_ptr, pointer, std::min(bootstrapBlockSize(pointer), size));
+        return new_ptr;
+    }
+#endif
+
+    Info info{};
+    if (!g_activated || g_state.is_tracing || !g_registry.find(pointer, info))
         return native_realloc(pointer, size);
 
-    const size_t old_size = g_allocated.at(pointer).size;
-    void* new_ptr = my_malloc(size);
+    if (g_scoped && !isInScope(caller)) {
+        // A tracked block which is reallocated out of scope is not tracked anymore.
+        g_registry.erase(pointer);
+        void* new_ptr = native_realloc(pointer, size);
+        if (!new_ptr)
+            trackReallocatedBlock(pointer, info);
+        return new_ptr;
+    }
+
+    unsigned int malloc_seq_num = 0;
+    unsigned int site = 0;
+    const AllocationVerdict verdict = judgeAllocation<RuntimeConfiguration>(size, malloc_seq_num, site);
+
+    if (verdict == ALLOCATION_FAIL)
+        return nullptr; // The original block stays untouched and tracked.
 
-    if (!new_ptr)
+    // The old entry is removed before the block is handed over to native_realloc,
+    // once the block is released another thread may get the same address and register it.
+    g_registry.erase(pointer);
+
+    // native_realloc keeps in-place growth (and mremap for huge blocks) of the underlying allocator, no copying is done here.
+    void* new_ptr = timeNativeCall(TIMING_ALLOCATE, size, [pointer, size]() { return native_realloc(pointer, size); });
+
+    if (!new_ptr) {
+        recordNativeFailure(size);
+        // Real OOM, the original block is still valid and is tracked again.
+        trackReallocatedBlock(pointer, info);
         return nullptr;
+    }
 
-    memcpy(new_ptr, pointer, std::min(old_size, size));
-    my_free(pointer);
+    if (verdict == ALLOCATION_TRACKED) {
+        // If the registry is unable to grow, the block can not be given back anymore, so it just stays untracked.
+        if (trackReallocatedBlock(new_ptr, Info{ malloc_seq_num, site, size }) && g_verbose_mode >= VERBOSE_ALL_ALLOCATIONS)
+            printAllocationTrace(false, malloc_seq_num);
+    }
 
     return new_ptr;
 }
 
+#if defined(PLATFORM_OS_LINUX)
+// C++ allocation functions are replaced too, so C++ allocations enter the decision pipeline directly instead of through malloc invoked by
+// operator new of the standard library: call stacks are one frame shorter and the first frame of a call site is the code which invoked new.
+// Failures are handled exactly as by the standard library: a new handler (if any) is invoked and the allocation is retried,
+// otherwise std::bad_alloc is thrown (its exception object is allocated by __cxa_allocate_exception, which is in the white list).
+// Blocks are obtained using malloc and posix_memalign, so every kind of operator delete is nothing but free.
+#if !defined(__cpp_aligned_new)
+namespace std {
+enum class align_val_t : size_t {};
+}
+#endif
+
+// my_malloc takes calls from overthrower itself for calls on behalf of the caller of operator new, so the scope is checked here.
+static void* newAllocation(size_t size, size_t alignment, bool is_nothrow, const void* caller)
+{
+    if (!size)
+        size = 1; // Every allocation has to return a distinct pointer.
+
+    const bool is_in_scope = !g_activated || !g_scoped || isInScope(caller);
+    for (;;) {
+        void* pointer = nullptr;
+        if (!alignment)
+            pointer = is_in_scope ? my_malloc(size) : native_malloc(size);
+        else if ((is_in_scope ? my_posix_memalign : native_posix_memalign)(&pointer, std::max(alignment, sizeof(void*)), size))
+            pointer = nullptr;
+        if (pointer)
+            return pointer;
+
+        const std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            if (is_nothrow)
+                return nullptr;
+            throw std::bad_alloc();
+        }
+        if (!is_nothrow) {
+            handler();
+            continue;
+        }
+        try {
+            handler();
+        }
+        catch (const std::bad_alloc&) {
+            return nullptr;
+        }
+    }
+}
+
+__attribute__((visibility("default"))) void* operator new(size_t size)
+{
+    return newAllocation(size, 0U, false, __builtin_return_address(0));
+}
+
+__attribute__((visibility("default"))) void* operator new[](size_t size)
+{
+    return newAllocation(size, 0U, false, __builtin_return_address(0));
+}
+
+__attribute__((visibility("default"))) void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    return newAllocation(size, 0U, true, __builtin_return_address(0));
+}
+
+__attribute__((visibility("default"))) void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    return newAllocation(size, 0U, true, __builtin_return_address(0));
+}
+
+__attribute__((visibility("default"))) void* operator new(size_t size, std::align_val_t alignment)
+{
+    return newAllocation(size, static_cast<size_t>(alignment), false, __builtin_return_address(0));
+}
+
+__attribute__((visibility("default"))) void* operator new[](size_t size, std::align_val_t alignment)
+{
+    return newAllocation(size, static_cast<size_t>(alignment), false, __builtin_return_address(0));
+}
+
+__attribute__((visibility("default"))) void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return newAllocation(size, static_cast<size_t>(alignment), true, __builtin_return_address(0));
+}
+
+__attribute__((visibility("default"))) void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return newAllocation(size, static_cast<size_t>(alignment), true, __builtin_return_address(0));
+}
+
+// The registry keeps a size of every tracked block anyway, sizes passed to sized deallocation functions are not needed.
+__attribute__((visibility("default"))) void operator delete(void* pointer) noexcept
+{
+    my_free(pointer);
+}
+
+__attribute__((visibility("default"))) void operator delete[](void* pointer) noexcept
+{
+    my_free(pointer);
+}
+
+__attribute__((visibility("default"))) void operator delete(void* pointer, const std::nothrow_t&) noexcept
+{
+    my_free(pointer);
+}
+
+__attribute__((visibility("default"))) void operator delete[](void* pointer, const std::nothrow_t&) noexcept
+{
+    my_free(pointer);
+}
+
+__attribute__((visibility("default"))) void operator delete(void* pointer, size_t) noexcept
+{
+    my_free(pointer);
+}
+
+__attribute__((visibility("default"))) void operator delete[](void* pointer, size_t) noexcept
+{
+    my_free(pointer);
+}
+
+__attribute__((visibility("default"))) void operator delete(void* pointer, std::align_val_t) noexcept
+{
+    my_free(pointer);
+}
+
+__attribute__((visibility("default"))) void operator delete[](void* pointer, std::align_val_t) noexcept
+{
+    my_free(pointer);
+}
+
+__attribute__((visibility("default"))) void operator delete(void* pointer, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    my_free(pointer);
+}
+
+__attribute__((visibility("default"))) void operator delete[](void* pointer, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    my_free(pointer);
+}
+
+__attribute__((visibility("default"))) void operator delete(void* pointer, size_t, std::align_val_t) noexcept
+{
+    my_free(pointer);
+}
+
+__attribute__((visibility("default"))) void operator delete[](void* pointer, size_t, std::align_val_t) noexcept
+{
+    my_free(pointer);
+}
+#endif
+
 #if defined(PLATFORM_OS_MAC_OS_X)
 struct interpose_t {
     void* substitute;
@@ -741,8 +4330,11 @@ struct interpose_t {
 };
 
 __attribute__((used)) static const interpose_t interposing_functions[] __attribute__((section("__DATA, __interpose"))) = {
-    { reinterpret_cast<void*>(my_malloc), reinterpret_cast<void*>(malloc) },   //
-    { reinterpret_cast<void*>(my_realloc), reinterpret_cast<void*>(realloc) }, //
-    { reinterpret_cast<void*>(my_free), reinterpret_cast<void*>(free) },       //
+    { reinterpret_cast<void*>(my_malloc), reinterpret_cast<void*>(malloc) },                 //
+    { reinterpret_cast<void*>(my_realloc), reinterpret_cast<void*>(realloc) },               //
+    { reinterpret_cast<void*>(my_free), reinterpret_cast<void*>(free) },                     //
+    { reinterpret_cast<void*>(my_calloc), reinterpret_cast<void*>(calloc) },                 //
+    { reinterpret_cast<void*>(my_posix_memalign), reinterpret_cast<void*>(posix_memalign) }, //
+    { reinterpret_cast<void*>(my_valloc), reinterpret_cast<void*>(valloc) },                 //
 };
 #endif
@@ -1,15 +1,111 @@
 #ifndef UUID_40B5F6F2_1336_11E9_BE5D_CF97C16D7468
 #define UUID_40B5F6F2_1336_11E9_BE5D_CF97C16D7468
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
+// Returns non zero if an allocation has to be failed.
+// thread_id is pthread_self() of an allocating thread, site identifies a call site (0 - unknown).
+typedef int (*OverthrowerStrategyCallback)(unsigned int seq_num, size_t size, unsigned long thread_id, unsigned int site, void* user_data);
+
+struct OverthrowerStrategy {
+    OverthrowerStrategyCallback callback;
+    void* user_data;
+};
+
+// user_data of overthrowerSizeThresholdStrategy, allocations of at least min_size bytes fail.
+struct OverthrowerSizeThreshold {
+    size_t min_size;
+};
+
+// user_data of overthrowerEveryNthStrategy, allocations offset, offset + period, offset + 2 * period, ... fail.
+struct OverthrowerEveryNth {
+    unsigned int period;
+    unsigned int offset;
+};
+
+#define OVERTHROWER_COMPOSITE_ANY 0
+#define OVERTHROWER_COMPOSITE_ALL 1
+
+// user_data of overthrowerCompositeStrategy, an allocation fails if any (all) of nested strategies decide to fail it.
+struct OverthrowerComposite {
+    const struct OverthrowerStrategy* strategies;
+    unsigned int count;
+    int mode;
+};
+
+#define OVERTHROWER_SIZE_CLASS_COUNT 16
+
+// Counters of the current (or the last) activation. Allocations which are neither failed, whitelisted, ignored, paused nor unsampled are tracked.
+// Live blocks and bytes are estimates of the whole heap when allocations are sampled (OVERTHROWER_SAMPLE_RATE).
+// size_classes[i] counts allocations of [2^i; 2^(i+1)) bytes, the first class also includes 0, the last one includes all bigger sizes.
+struct OverthrowerStats {
+    unsigned long long allocations;
+    unsigned long long failed;
+    unsigned long long whitelisted;
+    unsigned long long ignored;
+    unsigned long long paused;
+    unsigned long long live_blocks;
+    unsigned long long live_bytes;
+    unsigned long long peak_live_bytes;
+    unsigned long long size_classes[OVERTHROWER_SIZE_CLASS_COUNT];
+    unsigned long long unsampled; // New members are appended, so offsets of the older ones stay the same.
+};
+
+// overthrower.cpp shares the declarations above, the library defines all functions below itself.
+#ifndef OVERTHROWER_TYPES_ONLY
 void activateOverthrower() __attribute__((weak));
+void activateOverthrowerForThisThread() __attribute__((weak));
 unsigned int deactivateOverthrower() __attribute__((weak));
 void pauseOverthrower(unsigned int duration) __attribute__((weak));
 void resumeOverthrower() __attribute__((weak));
+void getOverthrowerCacheStats(unsigned long long* hits, unsigned long long* misses) __attribute__((weak));
+void getOverthrowerStats(struct OverthrowerStats* stats) __attribute__((weak));
+long long writeOverthrowerSnapshot(const char* path) __attribute__((weak));
+void setOverthrowerStrategy(OverthrowerStrategyCallback callback, void* user_data) __attribute__((weak));
+int overthrowerSizeThresholdStrategy(unsigned int seq_num, size_t size, unsigned long thread_id, unsigned int site, void* user_data) __attribute__((weak));
+int overthrowerEveryNthStrategy(unsigned int seq_num, size_t size, unsigned long thread_id, unsigned int site, void* user_data) __attribute__((weak));
+int overthrowerCompositeStrategy(unsigned int seq_num, size_t size, unsigned long thread_id, unsigned int site, void* user_data) __attribute__((weak));
+
+// Pauses overthrower until the end of the enclosing scope (works in C too), e.g. OVERTHROWER_SCOPED_PAUSE(0);
+static inline void overthrowerResumeScope(int* scope)
+{
+    (void)scope;
+    if (resumeOverthrower)
+        resumeOverthrower();
+}
+
+#define OVERTHROWER_CONCATENATE_IMPL(a, b) a##b
+#define OVERTHROWER_CONCATENATE(a, b) OVERTHROWER_CONCATENATE_IMPL(a, b)
+#define OVERTHROWER_SCOPED_PAUSE(duration)                                                                    \
+    __attribute__((cleanup(overthrowerResumeScope), unused)) int OVERTHROWER_CONCATENATE(overthrower_pause_, __LINE__) = \
+        (pauseOverthrower ? pauseOverthrower(duration) : (void)0, 0)
+#endif
 #ifdef __cplusplus
 }
+
+#ifndef OVERTHROWER_TYPES_ONLY
+// Pauses overthrower for the lifetime of an object.
+class OverthrowerPauseGuard {
+public:
+    explicit OverthrowerPauseGuard(unsigned int duration = 0)
+    {
+        if (pauseOverthrower)
+            pauseOverthrower(duration);
+    }
+
+    ~OverthrowerPauseGuard()
+    {
+        if (resumeOverthrower)
+            resumeOverthrower();
+    }
+
+    OverthrowerPauseGuard(const OverthrowerPauseGuard&) = delete;
+    OverthrowerPauseGuard& operator=(const OverthrowerPauseGuard&) = delete;
+};
+#endif
 #endif
 
 #endif
@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+"""Compares two live heap snapshots written by overthrower and shows heap growth by call site.
+
+Usage: snapshot_diff.py <older snapshot> <newer snapshot> [--top <count>]
+
+Both snapshots have to be written by the same process (possibly by different activations), call sites are identified by their stable
+identifiers: identifiers of call site cache slots which blocks refer to may be reused by other call sites between activations.
+A block is new if it is not in the older snapshot (a reused address with another sequential number is a new block too).
+"""
+
+from argparse import ArgumentParser
+from collections import namedtuple
+from struct import Struct
+
+MAGIC = b'OVTHSNAP'
+VERSION = 2
+
+HEADER = Struct('=8sIIQQ')
+BLOCK = Struct('=QQII')
+SITE = Struct('=IIQ')
+FRAME = Struct('=QQHHI')
+
+Block = namedtuple('Block', ['address', 'size', 'seq_num', 'site'])
+Snapshot = namedtuple('Snapshot', ['blocks', 'sites', 'stable_ids'])
+Growth = namedtuple('Growth', ['site', 'byte_delta', 'block_delta', 'new_blocks', 'bytes', 'blocks'])
+
+
+def load(path):
+    """Returns a snapshot: blocks keyed by address, symbolized frames keyed by stable call site identifiers
+    and stable identifiers keyed by call site cache identifiers which blocks refer to."""
+    with open(path, 'rb') as file:
+        data = file.read()
+
+    magic, version, block_record_size, block_count, site_count = HEADER.unpack_from(data, 0)
+    if magic != MAGIC or version != VERSION or block_record_size != BLOCK.size:
+        raise ValueError('{} is not a snapshot of overthrower'.format(path))
+
+    offset = HEADER.size
+    blocks = {}
+    for _ in range(block_count):
+        block = Block(*BLOCK.unpack_from(data, offset))
+        blocks[block.address] = block
+        offset += BLOCK.size
+
+    sites = {}
+    stable_ids = {}
+    for _ in range(site_count):
+        site, frame_count, stable_id = SITE.unpack_from(data, offset)
+        offset += SITE.size
+        frames = []
+        for depth in range(frame_count):
+            ip, function_offset, file_name_length, func_name_length, _ = FRAME.unpack_from(data, offset)
+            offset += FRAME.size
+            file_name = data[offset:offset + file_name_length].decode(errors='replace')
+            offset += file_name_length
+            func_name = data[offset:offset + func_name_length].decode(errors='replace')
+            offset += func_name_length
+            frames.append('#{:<2} 0x{:016x} {} - {} + 0x{:x}'.format(depth, ip, file_name, func_name, function_offset))
+        sites[stable_id] = frames
+        stable_ids[site] = stable_id
+
+    return Snapshot(blocks, sites, stable_ids)
+
+
+def diff(older, newer):
+    """Returns growth of every call site which has changed, sites which have grown the most come first."""
+    totals = {}
+
+    def site_totals(site):
+        return totals.setdefault(site, {'old_bytes': 0, 'old_blocks': 0, 'bytes': 0, 'blocks': 0, 'new_blocks': 0})
+
+    for block in older.blocks.values():
+        site = site_totals(older.stable_ids.get(block.site, 0))
+        site['old_bytes'] += block.size
+        site['old_blocks'] += 1
+    for block in newer.blocks.values():
+        site = site_totals(newer.stable_ids.get(block.site, 0))
+        site['bytes'] += block.size
+        site['blocks'] += 1
+        old_block = older.blocks.get(block.address)
+        if old_block is None or old_block.seq_num != block.seq_num:
+            site['new_blocks'] += 1
+
+    growth = [Growth(site, value['bytes'] - value['old_bytes'], value['blocks'] - value['old_blocks'], value['new_blocks'], value['bytes'],
+                     value['blocks']) for site, value in totals.items()]
+    growth = [site for site in growth if site.byte_delta or site.block_delta or site.new_blocks]
+    return sorted(growth, key=lambda site: (-site.byte_delta, -site.block_delta, site.site))
+
+
+def main():
+    parser = ArgumentParser(description='Shows heap growth by call site between two snapshots of overthrower.')
+    parser.add_argument('older')
+    parser.add_argument('newer')
+    parser.add_argument('--top', type=int, default=0, help='show only the given count of call sites')
+    arguments = parser.parse_args()
+
+    older = load(arguments.older)
+    newer = load(arguments.newer)
+    growth = diff(older, newer)
+    if arguments.top > 0:
+        growth = growth[:arguments.top]
+
+    byte_delta = sum(block.size for block in newer.blocks.values()) - sum(block.size for block in older.blocks.values())
+    print('Heap has changed by {:+} bytes, {:+} blocks.'.format(byte_delta, len(newer.blocks) - len(older.blocks)))
+    for site in growth:
+        print('\n### {:+} bytes, {:+} blocks ({} new, {} bytes in {} blocks now) ###'.format(site.byte_delta, site.block_delta, site.new_blocks,
+                                                                                             site.bytes, site.blocks))
+        frames = newer.sites.get(site.site) or older.sites.get(site.site)
+        print('\n'.join(frames) if frames else 'unknown call site')
+
+
+if __name__ == '__main__':
+    main()
@@ -13,7 +13,7 @@ export BUILD_DIR=${APPVEYOR_BUILD_FOLDER:-$(pwd)}
 build_tests() {
   mkdir -p "${BUILD_DIR}/$1"
   cd "${BUILD_DIR}/$1" || exit 1
-  cmake -DCMAKE_C_FLAGS="${CMAKE_C_FLAGS}" -DCMAKE_CXX_FLAGS="${CMAKE_CXX_FLAGS}" -DCMAKE_BUILD_TYPE="$2" -DCMAKE_VERBOSE_MAKEFILE=1 -DOVERTHROWER_WITH_LIBUNWIND="${USE_LIBUNWIND}" "${SOURCE_DIR}"
+  cmake -DCMAKE_C_FLAGS="${CMAKE_C_FLAGS}" -DCMAKE_CXX_FLAGS="${CMAKE_CXX_FLAGS}" -DCMAKE_BUILD_TYPE="$2" -DCMAKE_VERBOSE_MAKEFILE=1 -DOVERTHROWER_WITH_LIBUNWIND="${USE_LIBUNWIND}" -DOVERTHROWER_WITH_FAST_UNWIND="${USE_FAST_UNWIND}" "${SOURCE_DIR}"
   cmake --build .
 }
 
@@ -23,9 +23,11 @@ execute_tests() {
     LD_LIBRARY_PATH=. LD_PRELOAD=liboverthrower.so ./overthrower_free_null
     LD_LIBRARY_PATH=. LD_PRELOAD=liboverthrower.so ./overthrower_tests
     PATH="${PATH}:$(pwd)" LD_LIBRARY_PATH=. LD_PRELOAD=liboverthrower.so python3 -m pytest "${SOURCE_DIR}/tests.py" -v
+    LD_LIBRARY_PATH=. LD_PRELOAD=liboverthrower.so ./overthrower_bench --iterations 1000 --threads 1,4 > /dev/null
   elif [[ "$(uname)" == "Darwin" ]]; then
     DYLD_FORCE_FLAT_NAMESPACE=1 DYLD_INSERT_LIBRARIES=./Frameworks/overthrower.framework/Versions/Current/overthrower ./overthrower_free_null
     DYLD_FORCE_FLAT_NAMESPACE=1 DYLD_INSERT_LIBRARIES=./Frameworks/overthrower.framework/Versions/Current/overthrower ./overthrower_tests
+    DYLD_FORCE_FLAT_NAMESPACE=1 DYLD_INSERT_LIBRARIES=./Frameworks/overthrower.framework/Versions/Current/overthrower ./overthrower_bench --iterations 1000 --threads 1,4 > /dev/null
   fi
 }
 
@@ -25,3 +25,16 @@ void* somePureCFunction()
     deactivateOverthrower();
     return ptr;
 }
+
+int scopedPauseInPureC()
+{
+    int is_failed = 0;
+    activateOverthrower();
+    {
+        OVERTHROWER_SCOPED_PAUSE(0);
+        is_failed |= mallocMemsetFree() == NULL;
+    }
+    is_failed |= mallocMemsetFree() != NULL;
+    deactivateOverthrower();
+    return is_failed;
+}
@@ -1,14 +1,22 @@
 #include <algorithm>
 #include <atomic>
+#include <map>
 #include <mutex>
 #include <numeric>
 #include <random>
+#include <set>
 #include <thread>
 
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include "platform.h"
 
 #if defined(PLATFORM_OS_LINUX)
 #include <dlfcn.h>
+#include <malloc.h>
 #endif
 
 #include <gtest/gtest.h>
@@ -20,6 +28,14 @@
 #define STRATEGY_STEP 1U
 #define STRATEGY_PULSE 2U
 #define STRATEGY_NONE 3U
+#define STRATEGY_SITE 4U
+#define STRATEGY_SCHEDULE 5U
+
+#define MAX_PAUSE_RUNS 16U // Has to match overthrower.cpp.
+
+#define SEQUENCE_GLOBAL 0U
+#define SEQUENCE_BATCHED 1U
+#define SEQUENCE_THREAD 2U
 
 #define VERBOSE_NO 0U
 #define VERBOSE_FAILED_ALLOCATIONS 1U
@@ -37,7 +53,8 @@ static unsigned int randomNumber()
 
 GTEST_API_ int main(int argc, char** argv)
 {
-    if (!activateOverthrower || !deactivateOverthrower || !pauseOverthrower || !resumeOverthrower) {
+    if (!activateOverthrower || !deactivateOverthrower || !pauseOverthrower || !resumeOverthrower || !getOverthrowerCacheStats ||
+        !setOverthrowerStrategy || !getOverthrowerStats || !writeOverthrowerSnapshot) {
         fprintf(stderr, "Seems like overthrower has not been injected or not fully available. Nothing to do.\n");
         return EXIT_FAILURE;
     }
@@ -69,7 +86,26 @@ AbstractOverthrowerConfigurator::~AbstractOverthrowerConfigurator()
                               "OVERTHROWER_DELAY",
                               "OVERTHROWER_DURATION",
                               "OVERTHROWER_SELF_OVERTHROW",
-                              "OVERTHROWER_VERBOSE" }) {
+                              "OVERTHROWER_VERBOSE",
+                              "OVERTHROWER_WHITELIST",
+                              "OVERTHROWER_IGNORE_LIST",
+                              "OVERTHROWER_REPORT_FILE",
+                              "OVERTHROWER_LEAK_SITES",
+                              "OVERTHROWER_EXPLORE",
+                              "OVERTHROWER_EXPLORE_JOBS",
+                              "OVERTHROWER_SITES_FILE",
+                              "OVERTHROWER_SNAPSHOT_SIGNAL",
+                              "OVERTHROWER_SNAPSHOT_FILE",
+                              "OVERTHROWER_SEQUENCE",
+                              "OVERTHROWER_RECLAIM_LEAKS",
+                              "OVERTHROWER_TIMING",
+                              "OVERTHROWER_SAMPLE_RATE",
+                              "OVERTHROWER_SCHEDULE",
+                              "OVERTHROWER_SCHEDULE_RECORD",
+                              "OVERTHROWER_DEFERRED_TRACES",
+                              "OVERTHROWER_TARGET_LIBRARY",
+                              "OVERTHROWER_FORK_POLICY",
+                              "OVERTHROWER_QUIET" }) {
         unsetEnv(name);
     }
 }
@@ -257,6 +293,380 @@ TEST(Overthrower, MemoryLeak) // NOLINT
     }
 }
 
+#if defined(PLATFORM_OS_LINUX)
+TEST(Overthrower, ReclaimLeaks) // NOLINT
+{
+    static constexpr unsigned int block_count = 3;
+
+    OverthrowerConfiguratorNone overthrower_configurator;
+    OverthrowerConfiguratorNone::setEnv("OVERTHROWER_RECLAIM_LEAKS", 1U);
+    void* leaked_blocks[block_count];
+    activateOverthrower();
+    for (void*& block : leaked_blocks) {
+        block = malloc(777);
+        forced_memset(block, 0, 777);
+    }
+    EXPECT_EQ(deactivateOverthrower(), block_count);
+
+    // Leaked blocks have been given back to glibc, which hands recently freed blocks of the same size out first.
+    void* blocks[block_count];
+    for (void*& block : blocks) {
+        block = malloc(777);
+        forced_memset(block, 0, 777);
+    }
+    EXPECT_TRUE(std::is_permutation(blocks, blocks + block_count, leaked_blocks));
+    for (void* block : blocks)
+        free(block);
+}
+#endif
+
+static std::string readFile(const char* path)
+{
+    std::string content;
+    FILE* file = fopen(path, "rb");
+    EXPECT_NE(file, nullptr);
+    if (!file)
+        return content;
+    char buffer[4096];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), file)) != 0)
+        content.append(buffer, size);
+    fclose(file);
+    return content;
+}
+
+// A file which is created with the given content and removed once it goes out of scope (even if a test ends early).
+class TemporaryFile {
+public:
+    explicit TemporaryFile(const std::string& content = std::string())
+    {
+        const int fd = mkstemp(m_path);
+        EXPECT_GE(fd, 0);
+        if (fd < 0)
+            return;
+        EXPECT_EQ(write(fd, content.data(), content.size()), static_cast<ssize_t>(content.size()));
+        close(fd);
+    }
+
+    ~TemporaryFile() { unlink(m_path); }
+
+    TemporaryFile(const TemporaryFile&) = delete;
+    TemporaryFile& operator=(const TemporaryFile&) = delete;
+
+    const char* path() const { return m_path; }
+    std::string read() const { return readFile(m_path); }
+
+private:
+    char m_path[32] = "/tmp/overthrower_XXXXXX";
+};
+
+class ReportFile : public TemporaryFile {
+public:
+    ReportFile() { AbstractOverthrowerConfigurator::setEnv("OVERTHROWER_REPORT_FILE", path()); }
+};
+
+TEST(Overthrower, ReportFile) // NOLINT
+{
+    OverthrowerConfiguratorNone overthrower_configurator;
+    ReportFile report_file;
+    OverthrowerConfiguratorNone::setVerboseMode(VERBOSE_ALL_ALLOCATIONS);
+    activateOverthrower();
+    void* buffer = malloc(12345);
+    forced_memset(buffer, 0, 12345);
+    EXPECT_EQ(deactivateOverthrower(), 1);
+    free(buffer);
+
+    const std::string report = report_file.read();
+    EXPECT_NE(report.find("### Successful allocation, sequential number: 0 ###\n#1  "), std::string::npos);
+    EXPECT_NE(report.find("overthrower has detected not freed memory blocks with following addresses:\n0x"), std::string::npos);
+    EXPECT_NE(report.find("  -       0  -       12345\n^^^^^^^^^^^^^^^^^^  |  ^^^^^^  |  ^^^^^^^^^^\n"), std::string::npos);
+}
+
+TEST(Overthrower, DeferredTraces) // NOLINT
+{
+    static constexpr unsigned int iterations = 100;
+
+    OverthrowerConfiguratorPulse overthrower_configurator(10, 1);
+    ReportFile report_file;
+    OverthrowerConfiguratorPulse::setVerboseMode(VERBOSE_ALL_ALLOCATIONS);
+    OverthrowerConfiguratorPulse::setEnv("OVERTHROWER_DEFERRED_TRACES", 1U);
+    std::string pattern;
+    pattern.reserve(iterations);
+    activateOverthrower();
+    EXPECT_EQ(failureCounter(iterations, pattern), 1);
+    EXPECT_EQ(deactivateOverthrower(), 0);
+
+    // Traces are printed by a helper thread (or on deactivation) in the order allocations have been made.
+    const std::string report = report_file.read();
+    size_t position = 0;
+    for (unsigned int i = 0; i < iterations; ++i) {
+        const std::string header = std::string("\n### ") + (i == 10 ? "Failed" : "Successful") + " allocation, sequential number: " + std::to_string(i) +
+                                   " ###\n#1  0x";
+        position = report.find(header, position);
+        ASSERT_NE(position, std::string::npos) << header;
+    }
+    EXPECT_EQ(report.find("overthrower has dropped"), std::string::npos);
+}
+
+TEST(Overthrower, Timing) // NOLINT
+{
+    static constexpr unsigned int block_count = 100;
+
+    OverthrowerConfiguratorNone overthrower_configurator;
+    ReportFile report_file;
+    OverthrowerConfiguratorNone::setEnv("OVERTHROWER_TIMING", 1U);
+    void* blocks[block_count];
+    activateOverthrower();
+    for (void*& block : blocks) {
+        block = malloc(100);
+        forced_memset(block, 0, 100);
+    }
+    for (void* block : blocks)
+        free(block);
+    EXPECT_EQ(deactivateOverthrower(), 0);
+
+    const std::string report = report_file.read();
+    EXPECT_NE(report.find("overthrower has timed every 1 call(s) of the native allocator:\n"), std::string::npos);
+    EXPECT_NE(report.find("allocate  | [    64;    128) |      100 |        0 | "), std::string::npos);
+    EXPECT_NE(report.find("free      | [    64;    128) |      100 |        0 | "), std::string::npos);
+
+    // Histograms of a previous activation are not reported again.
+    const size_t report_size = report.size();
+    free(malloc(100));
+    OverthrowerConfiguratorNone::unsetEnv("OVERTHROWER_TIMING");
+    activateOverthrower();
+    EXPECT_EQ(deactivateOverthrower(), 0);
+    EXPECT_EQ(report_file.read().size(), report_size);
+}
+
+TEST(Overthrower, LeakSites) // NOLINT
+{
+    static constexpr unsigned int small_block_count = 3;
+
+    OverthrowerConfiguratorNone overthrower_configurator;
+    ReportFile report_file;
+    OverthrowerConfiguratorNone::setEnv("OVERTHROWER_LEAK_SITES", 1U);
+    void* small_blocks[small_block_count];
+    activateOverthrower();
+    for (void*& block : small_blocks) {
+        block = malloc(100);
+        forced_memset(block, 0, 100);
+    }
+    void* big_block = malloc(500);
+    forced_memset(big_block, 0, 500);
+    EXPECT_EQ(deactivateOverthrower(), small_block_count + 1U);
+    for (void* block : small_blocks)
+        free(block);
+    free(big_block);
+
+    const std::string report = report_file.read();
+    EXPECT_NE(report.find("overthrower has detected not freed memory blocks allocated at following call sites:\n"), std::string::npos);
+    const size_t big_site = report.find("\n### 1 block, 500 bytes ###\n#0  0x");
+    const size_t small_site = report.find("\n### 3 blocks, 300 bytes ###\n#0  0x");
+    EXPECT_NE(big_site, std::string::npos);
+    EXPECT_NE(small_site, std::string::npos);
+    EXPECT_LT(big_site, small_site); // Call sites are sorted by total size of leaked blocks.
+    EXPECT_EQ(report.find("|  malloc  |"), std::string::npos); // Blocks are not listed one by one.
+}
+
+// Mirrors the layout of a snapshot file (see overthrower.cpp).
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_record_size;
+    uint64_t block_count;
+    uint64_t site_count;
+};
+
+struct SnapshotBlock {
+    uint64_t address;
+    uint64_t size;
+    uint32_t seq_num;
+    uint32_t site;
+};
+
+struct SnapshotSite {
+    uint32_t site;
+    uint32_t frame_count;
+    uint64_t stable_id;
+};
+
+static void validateSnapshot(const std::string& snapshot, void* const* blocks, unsigned int block_count, size_t block_size)
+{
+    ASSERT_GE(snapshot.size(), sizeof(SnapshotHeader));
+    SnapshotHeader header{};
+    memcpy(&header, snapshot.data(), sizeof(header));
+    EXPECT_EQ(std::string(header.magic, sizeof(header.magic)), "OVTHSNAP");
+    EXPECT_EQ(header.version, 2U);
+    ASSERT_EQ(header.block_record_size, sizeof(SnapshotBlock));
+    ASSERT_EQ(header.block_count, block_count);
+    ASSERT_EQ(header.site_count, 1U); // All blocks are allocated at the same call site.
+    ASSERT_GE(snapshot.size(), sizeof(header) + block_count * sizeof(SnapshotBlock) + sizeof(SnapshotSite));
+
+    std::set<uint64_t> addresses;
+    uint32_t site = 0;
+    for (unsigned int i = 0; i < block_count; ++i) {
+        SnapshotBlock block{};
+        memcpy(&block, snapshot.data() + sizeof(header) + i * sizeof(block), sizeof(block));
+        EXPECT_EQ(block.size, block_size);
+        EXPECT_NE(block.site, 0U);
+        site = block.site;
+        addresses.insert(block.address);
+    }
+    for (unsigned int i = 0; i < block_count; ++i)
+        EXPECT_EQ(addresses.count(reinterpret_cast<uintptr_t>(blocks[i])), 1U);
+
+    SnapshotSite site_record{};
+    memcpy(&site_record, snapshot.data() + sizeof(header) + block_count * sizeof(SnapshotBlock), sizeof(site_record));
+    EXPECT_EQ(site_record.site, site);
+    EXPECT_GT(site_record.frame_count, 0U);
+    EXPECT_NE(site_record.stable_id, 0U);
+}
+
+// Counts in the header are written last, a snapshot is complete once they are there.
+static bool waitForSnapshot(const char* path, uint64_t block_count)
+{
+    for (unsigned int attempt = 0; attempt < 5000U; ++attempt) {
+        SnapshotHeader header{};
+        const int fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            const bool is_read = pread(fd, &header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header));
+            close(fd);
+            if (is_read && header.block_count == block_count)
+                return true;
+        }
+        usleep(1000);
+    }
+    return false;
+}
+
+TEST(Overthrower, Snapshot) // NOLINT
+{
+    static constexpr unsigned int block_count = 3;
+    const TemporaryFile snapshot_file;
+
+    OverthrowerConfiguratorNone overthrower_configurator;
+    void* blocks[block_count];
+    activateOverthrower();
+    for (void*& block : blocks) {
+        block = malloc(321);
+        forced_memset(block, 0, 321);
+    }
+    const long long snapshot_block_count = writeOverthrowerSnapshot(snapshot_file.path());
+    for (void* block : blocks)
+        free(block);
+    EXPECT_EQ(deactivateOverthrower(), 0U);
+
+    EXPECT_EQ(snapshot_block_count, block_count);
+    validateSnapshot(snapshot_file.read(), blocks, block_count, 321);
+    EXPECT_EQ(writeOverthrowerSnapshot("/nonexistent/overthrower.snapshot"), -1);
+}
+
+TEST(Overthrower, SnapshotSignal) // NOLINT
+{
+    static constexpr unsigned int block_count = 2;
+    const TemporaryFile prefix;
+
+    OverthrowerConfiguratorNone overthrower_configurator;
+    OverthrowerConfiguratorNone::setEnv("OVERTHROWER_SNAPSHOT_SIGNAL", static_cast<unsigned int>(SIGUSR2));
+    OverthrowerConfiguratorNone::setEnv("OVERTHROWER_SNAPSHOT_FILE", prefix.path());
+    const std::string path = std::string(prefix.path()) + ".1";
+    void* blocks[block_count];
+    activateOverthrower();
+    for (void*& block : blocks) {
+        block = malloc(123);
+        forced_memset(block, 0, 123);
+    }
+    EXPECT_EQ(raise(SIGUSR2), 0);
+    EXPECT_TRUE(waitForSnapshot(path.c_str(), block_count));
+    for (void* block : blocks)
+        free(block);
+    EXPECT_EQ(deactivateOverthrower(), 0U);
+
+    // The signal is not handled by overthrower anymore.
+    struct sigaction action {};
+    EXPECT_EQ(sigaction(SIGUSR2, nullptr, &action), 0);
+    EXPECT_EQ(action.sa_handler, SIG_DFL);
+
+    validateSnapshot(readFile(path.c_str()), blocks, block_count, 123);
+    unlink(path.c_str());
+}
+
+TEST(Overthrower, Exploration) // NOLINT
+{
+    OverthrowerConfiguratorNone overthrower_configurator;
+    ReportFile report_file;
+    OverthrowerConfiguratorNone::setEnv("OVERTHROWER_EXPLORE", 100U);
+    OverthrowerConfiguratorNone::setEnv("OVERTHROWER_EXPLORE_JOBS", 2U);
+    // The parent process continues with the configured strategy once all allocations have been explored.
+    activateOverthrower();
+    void* first = malloc(128);
+    void* second = malloc(128);
+    if (!first)
+        _exit(3);
+    if (!second) {
+        // Deliberately leaked.
+        EXPECT_EQ(deactivateOverthrower(), 1);
+    }
+    void* third = malloc(128);
+    if (!third)
+        abort();
+    free(third);
+    free(second);
+    free(first);
+    EXPECT_EQ(deactivateOverthrower(), 0);
+    OverthrowerConfiguratorNone::unsetEnv("OVERTHROWER_EXPLORE");
+    OverthrowerConfiguratorNone::unsetEnv("OVERTHROWER_EXPLORE_JOBS");
+
+    const std::string report = report_file.read();
+    EXPECT_NE(report.find("overthrower has explored 3 allocation(s) using 2 job(s):\n"
+                          "       0  -  exited with code 3 before deactivation\n"
+                          "       1  -  leaked 1 block(s)\n"
+                          "       2  -  crashed (signal 6)\n"),
+              std::string::npos);
+    EXPECT_NE(report.find("0 passed, 1 leaked, 1 exited, 1 crashed\n"), std::string::npos);
+}
+
+#if defined(PLATFORM_OS_LINUX) || \
+    (defined(PLATFORM_OS_MAC_OS_X) && __apple_build_version__ >= 9000037) // Xcode 9.0 (installed on macOS 10.13 (High Sierra) on Travis CI)
+TEST(Overthrower, MultipleThreadsMemoryLeak) // NOLINT
+{
+    static constexpr unsigned int thread_count = 32;
+    static constexpr unsigned int block_count = 4096;
+    static constexpr unsigned int leaked_block_count = 3;
+
+    OverthrowerConfiguratorNone overthrower_configurator;
+    std::vector<void*> leaked_blocks(thread_count * leaked_block_count);
+    std::thread threads[thread_count];
+
+    activateOverthrower();
+
+    for (unsigned int i = 0; i < thread_count; ++i) {
+        threads[i] = std::thread([i, &leaked_blocks]() {
+            std::vector<void*> blocks(block_count);
+            for (auto& block : blocks) {
+                block = malloc(16 + randomNumber() % 256);
+                forced_memset(block, 0, 16);
+            }
+            for (unsigned int j = 0; j < block_count; ++j) {
+                if (j < leaked_block_count)
+                    leaked_blocks[i * leaked_block_count + j] = blocks[j];
+                else
+                    free(blocks[j]);
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+        thread.join();
+
+    EXPECT_EQ(deactivateOverthrower(), thread_count * leaked_block_count);
+
+    for (void* block : leaked_blocks)
+        free(block);
+}
+#endif
+
 TEST(Overthrower, DoubleActivation) // NOLINT
 {
     OverthrowerConfiguratorNone overthrower_configurator;
@@ -304,6 +714,160 @@ TEST(Overthrower, Deactivation) // NOLINT
     EXPECT_EQ(buffer, nullptr);
 }
 
+TEST(Overthrower, CallSiteCache) // NOLINT
+{
+    static constexpr unsigned int iterations = 1024;
+
+    OverthrowerConfiguratorNone overthrower_configurator;
+    activateOverthrower();
+    fragileCode(iterations);
+    unsigned long long hits = 0;
+    unsigned long long misses = 0;
+    getOverthrowerCacheStats(&hits, &misses);
+    EXPECT_EQ(deactivateOverthrower(), 0);
+
+    // All iterations allocate from the very same call site, only the first one has to inspect the stack.
+    EXPECT_GT(misses, 0U);
+    EXPECT_GE(hits, iterations - 1U);
+    EXPECT_LT(misses, hits);
+}
+
+TEST(Overthrower, Stats) // NOLINT
+{
+    static constexpr unsigned int thread_count = 4;
+    static constexpr unsigned int iterations = 100;
+
+    OverthrowerConfiguratorStep overthrower_configurator(2 + thread_count * iterations);
+    OverthrowerStats stats{};
+    std::atomic<bool> start_flag{};
+    std::vector<std::thread> threads;
+    threads.reserve(thread_count);
+    for (unsigned int i = 0; i < thread_count; ++i) {
+        threads.emplace_back([&start_flag]() {
+            while (!start_flag) {
+            }
+            for (unsigned int j = 0; j < iterations; ++j) {
+                void* block = malloc(100);
+                forced_memset(block, 0, 100);
+                free(block);
+            }
+        });
+    }
+
+    activateOverthrower();
+    void* small_block = malloc(1);
+    forced_memset(small_block, 0, 1);
+    void* big_block = malloc(5000);
+    forced_memset(big_block, 0, 5000);
+    start_flag = true;
+    for (auto& thread : threads)
+        thread.join();
+    pauseOverthrower(1);
+    fragileCode(1);
+    void* failed_block = malloc(10);
+    getOverthrowerStats(&stats);
+    free(big_block);
+    EXPECT_EQ(deactivateOverthrower(), 1);
+    free(small_block);
+
+    EXPECT_EQ(stats.allocations, 4 + thread_count * iterations);
+    EXPECT_EQ(stats.failed, 1);
+    EXPECT_EQ(stats.paused, 1);
+    EXPECT_EQ(stats.live_blocks, 2);
+    EXPECT_EQ(stats.live_bytes, 5001);
+    EXPECT_GE(stats.peak_live_bytes, 5001);
+    EXPECT_EQ(stats.size_classes[0], 1);                         // 1 byte
+    EXPECT_EQ(stats.size_classes[2], 1);                         // 7 bytes (strdup)
+    EXPECT_EQ(stats.size_classes[3], 1);                         // 10 bytes
+    EXPECT_EQ(stats.size_classes[6], thread_count * iterations); // 100 bytes
+    EXPECT_EQ(stats.size_classes[12], 1);                        // 5000 bytes
+    EXPECT_EQ(failed_block, nullptr);
+
+    // Counters of the last activation are kept, live blocks are the leaked ones.
+    getOverthrowerStats(&stats);
+    EXPECT_EQ(stats.live_blocks, 1);
+    EXPECT_EQ(stats.live_bytes, 1);
+}
+
+TEST(Overthrower, SampledTracking) // NOLINT
+{
+    static constexpr unsigned int block_count = 100000;
+    static constexpr unsigned int sample_rate = 65536;
+
+    std::vector<void*> blocks(block_count);
+    OverthrowerStats stats{};
+    {
+        OverthrowerConfiguratorNone overthrower_configurator;
+        ReportFile report_file;
+        OverthrowerConfiguratorNone::setEnv("OVERTHROWER_SAMPLE_RATE", sample_rate);
+        activateOverthrower();
+        for (void*& block : blocks) {
+            block = malloc(64);
+            forced_memset(block, 0, 64);
+        }
+        getOverthrowerStats(&stats);
+        for (void* block : blocks)
+            free(block);
+        // A block which is much bigger than the sample rate is sampled for sure.
+        void* leaked_block = malloc(1U << 20U);
+        forced_memset(leaked_block, 0, 1U << 20U);
+        EXPECT_EQ(deactivateOverthrower(), 1);
+        free(leaked_block);
+
+        EXPECT_NE(report_file.read().find(" sampled block(s) stand for about 1 leaked block(s) of 1048576 byte(s)\n"), std::string::npos);
+    }
+
+    // About 100 blocks are sampled, live counters are estimates of all allocated blocks.
+    EXPECT_EQ(stats.allocations, block_count);
+    EXPECT_GT(stats.unsampled, block_count - 200U);
+    EXPECT_LT(stats.unsampled, block_count - 50U);
+    EXPECT_GT(stats.live_blocks, block_count * 6U / 10U);
+    EXPECT_LT(stats.live_blocks, block_count * 14U / 10U);
+    EXPECT_GT(stats.live_bytes, block_count * 64U * 6U / 10U);
+    EXPECT_LT(stats.live_bytes, block_count * 64U * 14U / 10U);
+
+    // Only sampled allocations may be failed.
+    OverthrowerConfiguratorStep overthrower_configurator(0);
+    OverthrowerConfiguratorStep::setEnv("OVERTHROWER_SAMPLE_RATE", sample_rate);
+    activateOverthrower();
+    unsigned int succeeded = 0;
+    for (void*& block : blocks) {
+        block = malloc(64);
+        succeeded += block != nullptr;
+    }
+    void* big_block = malloc(1U << 20U);
+    for (void* block : blocks)
+        free(block);
+    EXPECT_EQ(deactivateOverthrower(), 0);
+    EXPECT_EQ(big_block, nullptr);
+    EXPECT_GT(succeeded, block_count - 200U);
+    EXPECT_LT(succeeded, block_count - 50U);
+}
+
+TEST(Overthrower, RegistryGrowth) // NOLINT
+{
+    static constexpr unsigned int block_count = 100000;
+
+    std::vector<void*> blocks(block_count);
+    std::vector<unsigned int> order(block_count);
+    std::iota(order.begin(), order.end(), 0U);
+    std::shuffle(order.begin(), order.end(), std::mt19937{ 0U });
+
+    OverthrowerConfiguratorNone overthrower_configurator;
+    ReportFile report_file; // Half of blocks are reported as leaked.
+    activateOverthrower();
+    for (void*& block : blocks) {
+        block = malloc(8);
+        forced_memset(block, 0, 8);
+    }
+    // Blocks are freed in random order, so tables have to handle removal from all over their probe sequences.
+    for (unsigned int i = 0; i < block_count / 2U; ++i)
+        free(blocks[order[i]]);
+    EXPECT_EQ(deactivateOverthrower(), block_count / 2U);
+    for (unsigned int i = block_count / 2U; i < block_count; ++i)
+        free(blocks[order[i]]);
+}
+
 TEST(Overthrower, FreePreAllocated) // NOLINT
 {
     void* buffer = malloc(128);
@@ -449,7 +1013,76 @@ TEST(Overthrower, NestedPauseOverflowUnderflow) // NOLINT
 
     EXPECT_EQ(deactivateOverthrower(), 0);
     EXPECT_EQ(buffer1, nullptr);
+    EXPECT_NE(buffer2, nullptr); // Deep nesting is not truncated, the infinite pause is back.
+    free(buffer2);
+}
+
+TEST(Overthrower, NestedPauseRunsOverflow) // NOLINT
+{
+    OverthrowerConfiguratorStep overthrower_configurator(0);
+    activateOverthrower();
+
+    // Every level has a distinct duration, so every level takes a run of its own and the last one does not fit.
+    for (unsigned int i = 1; i < MAX_PAUSE_RUNS; ++i)
+        pauseOverthrower(100U + i);
+    void* buffer = nullptr;
+    {
+        OverthrowerPauseGuard pause_guard;
+        pauseOverthrower(5);
+        fragileCode(5);
+        resumeOverthrower();
+        buffer = malloc(128); // The infinite pause survives.
+    }
+    for (unsigned int i = 1; i < MAX_PAUSE_RUNS; ++i)
+        resumeOverthrower();
+
+    EXPECT_EQ(deactivateOverthrower(), 0);
+    EXPECT_NE(buffer, nullptr);
+    free(buffer);
+}
+
+TEST(Overthrower, DeepNestedPause) // NOLINT
+{
+    static constexpr unsigned int max_depth = 4096;
+
+    OverthrowerConfiguratorStep overthrower_configurator(0);
+    activateOverthrower();
+
+    for (unsigned int i = 0; i < max_depth; ++i)
+        pauseOverthrower(0);
+    pauseOverthrower(1);
+    fragileCode(1);
+    void* buffer1 = malloc(128);
+    resumeOverthrower();
+    void* buffers[max_depth] = {};
+    for (void*& buffer : buffers) {
+        buffer = malloc(128);
+        resumeOverthrower();
+    }
+    void* buffer2 = malloc(128);
+
+    EXPECT_EQ(deactivateOverthrower(), 0);
+    EXPECT_EQ(buffer1, nullptr);
+    EXPECT_EQ(std::count(std::begin(buffers), std::end(buffers), nullptr), 0);
     EXPECT_EQ(buffer2, nullptr);
+    for (void* buffer : buffers)
+        free(buffer);
+}
+
+TEST(Overthrower, ScopedPause) // NOLINT
+{
+    OverthrowerConfiguratorStep overthrower_configurator(0);
+    activateOverthrower();
+    void* buffers[2] = {};
+    {
+        OverthrowerPauseGuard pause_guard;
+        buffers[0] = malloc(128);
+    }
+    buffers[1] = malloc(128);
+    EXPECT_EQ(deactivateOverthrower(), 0);
+    EXPECT_NE(buffers[0], nullptr);
+    EXPECT_EQ(buffers[1], nullptr);
+    free(buffers[0]);
 }
 
 TEST(Overthrower, PauseNotActivated) // NOLINT
@@ -569,6 +1202,55 @@ TEST(Overthrower, StrategyRandom) // NOLINT
     }
 }
 
+TEST(Overthrower, StrategyRandomReproducible) // NOLINT
+{
+    static constexpr unsigned int run_count = 3;
+    static constexpr unsigned int iterations = 4096;
+
+    std::string first_pattern;
+    for (unsigned int run = 0; run < run_count; ++run) {
+        OverthrowerConfiguratorRandom overthrower_configurator(3);
+        std::string real_pattern(iterations, '?');
+        std::atomic<unsigned int> malloc_seq_num{};
+        activateOverthrower();
+        failureCounter(iterations, real_pattern, &malloc_seq_num);
+        EXPECT_EQ(deactivateOverthrower(), 0);
+        if (run == 0)
+            first_pattern = real_pattern;
+        else
+            EXPECT_EQ(real_pattern, first_pattern);
+    }
+
+#if defined(PLATFORM_OS_LINUX) || \
+    (defined(PLATFORM_OS_MAC_OS_X) && __apple_build_version__ >= 9000037) // Xcode 9.0 (installed on macOS 10.13 (High Sierra) on Travis CI)
+    static constexpr unsigned int thread_count = 4;
+
+    // Every thread gets its own sequence, which depends only on the seed and an order in which threads have started to allocate.
+    std::vector<std::string> first_patterns;
+    for (unsigned int run = 0; run < run_count; ++run) {
+        OverthrowerConfiguratorRandom overthrower_configurator(3);
+        std::vector<std::string> real_patterns(thread_count, std::string(iterations, '?'));
+        activateOverthrower();
+        for (unsigned int i = 0; i < thread_count; ++i) {
+            pauseOverthrower(0);
+            std::thread thread([&real_patterns, i]() {
+                std::atomic<unsigned int> malloc_seq_num{};
+                failureCounter(iterations, real_patterns[i], &malloc_seq_num);
+            });
+            resumeOverthrower();
+            thread.join();
+        }
+        EXPECT_EQ(deactivateOverthrower(), 0);
+        for (unsigned int i = 1; i < thread_count; ++i)
+            EXPECT_NE(real_patterns[i], real_patterns[0]);
+        if (run == 0)
+            first_patterns = real_patterns;
+        else
+            EXPECT_EQ(real_patterns, first_patterns);
+    }
+#endif
+}
+
 TEST(Overthrower, StrategyStep) // NOLINT
 {
 #if defined(PLATFORM_OS_LINUX) || \
@@ -694,6 +1376,415 @@ TEST(Overthrower, StrategyNone) // NOLINT
     EXPECT_EQ(deactivateOverthrower(), 0);
 }
 
+TEST(Overthrower, SequenceBatched) // NOLINT
+{
+    static constexpr unsigned int iterations = 200;
+    static constexpr unsigned int delay = 100; // Beyond the first batch of sequential numbers.
+    static constexpr unsigned int duration = 3;
+
+    // A single thread gets exactly the same numbers as with the global counter.
+    const std::string expected_pattern = generateExpectedPattern(STRATEGY_PULSE, iterations, delay, duration);
+    std::string real_pattern;
+    real_pattern.reserve(iterations);
+    OverthrowerConfiguratorPulse overthrower_configurator(delay, duration);
+    OverthrowerConfiguratorPulse::setEnv("OVERTHROWER_SEQUENCE", SEQUENCE_BATCHED);
+    activateOverthrower();
+    EXPECT_EQ(failureCounter(iterations, real_pattern), duration);
+    EXPECT_EQ(deactivateOverthrower(), 0);
+    EXPECT_EQ(real_pattern, expected_pattern);
+}
+
+struct SequenceRecorder {
+    std::mutex mutex;
+    std::vector<std::pair<unsigned long, unsigned int>> seq_nums; // thread_id, seq_num pairs.
+};
+
+static int recordSeqNum(unsigned int seq_num, size_t, unsigned long thread_id, unsigned int, void* user_data)
+{
+    auto recorder = static_cast<SequenceRecorder*>(user_data);
+    std::lock_guard<std::mutex> lock(recorder->mutex);
+    recorder->seq_nums.emplace_back(thread_id, seq_num);
+    return 0;
+}
+
+TEST(Overthrower, SequenceModes) // NOLINT
+{
+    static constexpr unsigned int thread_count = 4;
+    static constexpr unsigned int iterations = 100;
+
+    for (unsigned int sequence_mode : { SEQUENCE_GLOBAL, SEQUENCE_BATCHED, SEQUENCE_THREAD }) {
+        SequenceRecorder recorder;
+        recorder.seq_nums.reserve(thread_count * iterations * 2U);
+        std::atomic<bool> start_flag{};
+        std::vector<std::thread> threads;
+        threads.reserve(thread_count);
+        for (unsigned int i = 0; i < thread_count; ++i) {
+            threads.emplace_back([&start_flag]() {
+                while (!start_flag) {
+                }
+                fragileCode(iterations);
+            });
+        }
+
+        OverthrowerConfiguratorNone overthrower_configurator;
+        OverthrowerConfiguratorNone::setEnv("OVERTHROWER_SEQUENCE", sequence_mode);
+        setOverthrowerStrategy(recordSeqNum, &recorder);
+        activateOverthrower();
+        start_flag = true;
+        for (auto& thread : threads)
+            thread.join();
+        EXPECT_EQ(deactivateOverthrower(), 0);
+        setOverthrowerStrategy(nullptr, nullptr);
+
+        ASSERT_EQ(recorder.seq_nums.size(), thread_count * iterations);
+        std::map<unsigned long, std::vector<unsigned int>> thread_seq_nums;
+        std::set<unsigned int> unique_seq_nums;
+        for (const auto& record : recorder.seq_nums) {
+            thread_seq_nums[record.first].push_back(record.second);
+            unique_seq_nums.insert(record.second);
+        }
+        ASSERT_EQ(thread_seq_nums.size(), thread_count);
+        if (sequence_mode == SEQUENCE_THREAD) {
+            // Every thread counts from zero on its own.
+            std::vector<unsigned int> expected_seq_nums(iterations);
+            std::iota(expected_seq_nums.begin(), expected_seq_nums.end(), 0U);
+            for (const auto& seq_nums : thread_seq_nums)
+                EXPECT_EQ(seq_nums.second, expected_seq_nums);
+        }
+        else {
+            EXPECT_EQ(unique_seq_nums.size(), thread_count * iterations);
+            for (const auto& seq_nums : thread_seq_nums)
+                EXPECT_TRUE(std::is_sorted(seq_nums.second.begin(), seq_nums.second.end()));
+        }
+        if (sequence_mode == SEQUENCE_GLOBAL)
+            EXPECT_EQ(*unique_seq_nums.rbegin(), thread_count * iterations - 1U);
+    }
+}
+
+static void siteFailurePattern(char* pattern, unsigned int iterations)
+{
+    for (unsigned int i = 0; i < iterations; ++i) {
+        void* first = malloc(64);
+        void* second = malloc(64);
+        *pattern++ = first ? '+' : '-';
+        *pattern++ = second ? '+' : '-';
+        free(first);
+        free(second);
+    }
+}
+
+TEST(Overthrower, StrategySite) // NOLINT
+{
+    static constexpr unsigned int iterations = 4;
+    const TemporaryFile sites_file;
+
+    OverthrowerConfiguratorNone overthrower_configurator;
+    OverthrowerConfiguratorNone::setEnv("OVERTHROWER_STRATEGY", STRATEGY_SITE);
+    char patterns[3][iterations * 2U + 1U] = {};
+
+    // A call site includes callers of siteFailurePattern, so it is invoked from the same place every time.
+    OverthrowerConfiguratorNone::setEnv("OVERTHROWER_SITES_FILE", sites_file.path());
+    for (char* pattern : patterns) {
+        // Without a file every activation starts from scratch.
+        if (pattern == patterns[2])
+            OverthrowerConfiguratorNone::unsetEnv("OVERTHROWER_SITES_FILE");
+        activateOverthrower();
+        siteFailurePattern(pattern, iterations);
+        EXPECT_EQ(deactivateOverthrower(), 0);
+    }
+
+    EXPECT_STREQ(patterns[0], "--++++++"); // The first allocation from every call site fails.
+    EXPECT_STREQ(patterns[1], "++++++++"); // Call sites which have already been exercised are loaded from the file.
+    EXPECT_STREQ(patterns[2], "--++++++");
+}
+
+TEST(Overthrower, StrategySchedule) // NOLINT
+{
+    static constexpr unsigned int iterations = 10;
+
+    const TemporaryFile schedule_file("7\n3\n1\n3\n12\n"); // Entries do not have to be sorted or unique.
+
+    OverthrowerConfiguratorNone overthrower_configurator;
+    OverthrowerConfiguratorNone::setEnv("OVERTHROWER_STRATEGY", STRATEGY_SCHEDULE);
+    OverthrowerConfiguratorNone::setEnv("OVERTHROWER_SCHEDULE", schedule_file.path());
+    std::string pattern;
+    pattern.reserve(iterations);
+    activateOverthrower();
+    EXPECT_EQ(failureCounter(iterations, pattern), 3);
+    EXPECT_EQ(deactivateOverthrower(), 0);
+    EXPECT_EQ(pattern, "+-+-+++-++");
+
+    // Without a schedule nothing fails.
+    OverthrowerConfiguratorNone::unsetEnv("OVERTHROWER_SCHEDULE");
+    pattern.clear();
+    activateOverthrower();
+    EXPECT_EQ(failureCounter(iterations, pattern), 0);
+    EXPECT_EQ(deactivateOverthrower(), 0);
+}
+
+TEST(Overthrower, StrategyScheduleReplay) // NOLINT
+{
+    static constexpr unsigned int iterations = 1000;
+    const TemporaryFile schedule_file;
+
+    std::string patterns[2];
+    for (std::string& pattern : patterns)
+        pattern.reserve(iterations);
+    {
+        // Random strategy records failures it has produced in verbose mode.
+        OverthrowerConfiguratorRandom overthrower_configurator(8);
+        ReportFile report_file;
+        OverthrowerConfiguratorRandom::setEnv("OVERTHROWER_SEED", static_cast<unsigned int>(randomNumber()));
+        OverthrowerConfiguratorRandom::setVerboseMode(VERBOSE_FAILED_ALLOCATIONS);
+        OverthrowerConfiguratorRandom::setEnv("OVERTHROWER_SCHEDULE_RECORD", schedule_file.path());
+        OverthrowerConfiguratorRandom::setEnv("OVERTHROWER_SCHEDULE", "/nonexistent/schedule"); // Is not touched by recording.
+        activateOverthrower();
+        failureCounter(iterations, patterns[0]);
+        EXPECT_EQ(deactivateOverthrower(), 0);
+    }
+
+    OverthrowerConfiguratorNone overthrower_configurator;
+    OverthrowerConfiguratorNone::setEnv("OVERTHROWER_STRATEGY", STRATEGY_SCHEDULE);
+    OverthrowerConfiguratorNone::setEnv("OVERTHROWER_SCHEDULE", schedule_file.path());
+    activateOverthrower();
+    failureCounter(iterations, patterns[1]);
+    EXPECT_EQ(deactivateOverthrower(), 0);
+
+    EXPECT_NE(patterns[0].find('-'), std::string::npos);
+    EXPECT_EQ(patterns[0], patterns[1]);
+}
+
+TEST(Overthrower, QuietStrategyFiles) // NOLINT
+{
+    const TemporaryFile sites_file;
+    const TemporaryFile schedule_file("1\n");
+
+    OverthrowerConfiguratorNone overthrower_configurator;
+    OverthrowerConfiguratorNone::setEnv("OVERTHROWER_QUIET", 1U);
+    OverthrowerConfiguratorNone::setEnv("OVERTHROWER_SITES_FILE", sites_file.path());
+    OverthrowerConfiguratorNone::setEnv("OVERTHROWER_SCHEDULE", schedule_file.path());
+    for (const unsigned int strategy : { STRATEGY_SITE, STRATEGY_SCHEDULE }) {
+        OverthrowerConfiguratorNone::setEnv("OVERTHROWER_STRATEGY", strategy);
+        testing::internal::CaptureStderr();
+        activateOverthrower();
+        EXPECT_EQ(deactivateOverthrower(), 0);
+        EXPECT_EQ(testing::internal::GetCapturedStderr(), "") << "strategy " << strategy;
+    }
+}
+
+TEST(Overthrower, ThreadScope) // NOLINT
+{
+    OverthrowerConfiguratorStep overthrower_configurator(0);
+    std::atomic<unsigned int> stage{ 0 };
+    void* other_blocks[2] = {};
+    std::thread thread([&stage, &other_blocks]() {
+        while (stage != 1) {
+        }
+        other_blocks[0] = malloc(10); // Out of scope, neither failed nor tracked.
+        activateOverthrowerForThisThread();
+        other_blocks[1] = malloc(10);
+        stage = 2;
+    });
+
+    activateOverthrowerForThisThread();
+    void* block = malloc(10);
+    stage = 1;
+    while (stage != 2) {
+    }
+    EXPECT_EQ(deactivateOverthrower(), 0);
+    thread.join();
+
+    EXPECT_EQ(block, nullptr);
+    EXPECT_NE(other_blocks[0], nullptr);
+    EXPECT_EQ(other_blocks[1], nullptr);
+    free(other_blocks[0]);
+}
+
+#if defined(PLATFORM_OS_LINUX)
+TEST(Overthrower, TargetLibrary) // NOLINT
+{
+    char path[4096] = {};
+    ASSERT_GT(readlink("/proc/self/exe", path, sizeof(path) - 1U), 0);
+    const char* executable = strrchr(path, '/') + 1;
+
+    // Only allocation functions invoked right from the target are in scope, strdup allocates on behalf of it from libc.
+    OverthrowerConfiguratorStep overthrower_configurator(0);
+    OverthrowerConfiguratorStep::setEnv("OVERTHROWER_TARGET_LIBRARY", executable);
+    activateOverthrower();
+    void* block = malloc(10);
+    void* object = operator new(10, std::nothrow);
+    char* string = strdup("string");
+    EXPECT_EQ(deactivateOverthrower(), 0);
+    EXPECT_EQ(block, nullptr);
+    EXPECT_EQ(object, nullptr);
+    EXPECT_NE(string, nullptr);
+    free(string);
+
+    OverthrowerConfiguratorStep::setEnv("OVERTHROWER_TARGET_LIBRARY", "libc.so.6");
+    activateOverthrower();
+    block = malloc(10);
+    string = strdup("string");
+    EXPECT_EQ(deactivateOverthrower(), 0);
+    EXPECT_NE(block, nullptr);
+    EXPECT_EQ(string, nullptr);
+    free(block);
+}
+#endif
+
+// Runs child in a forked process, an exit code of the child is returned.
+template <typename Child>
+static int forkedExitCode(Child child)
+{
+    const pid_t pid = fork();
+    if (pid == 0)
+        _exit(child());
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+        return -1;
+    return WEXITSTATUS(status);
+}
+
+TEST(Overthrower, ForkPolicy) // NOLINT
+{
+    OverthrowerConfiguratorNone overthrower_configurator;
+    activateOverthrower();
+    void* block = malloc(10);
+    forced_memset(block, 0, 10);
+    EXPECT_EQ(forkedExitCode([]() { return static_cast<int>(deactivateOverthrower()); }), 1);
+    EXPECT_EQ(deactivateOverthrower(), 1);
+    free(block);
+
+    // A child starts from scratch, but it still tracks its own blocks.
+    OverthrowerConfiguratorNone::setEnv("OVERTHROWER_FORK_POLICY", 1U);
+    activateOverthrower();
+    block = malloc(10);
+    forced_memset(block, 0, 10);
+    EXPECT_EQ(forkedExitCode([]() {
+                  OverthrowerStats stats{};
+                  getOverthrowerStats(&stats);
+                  if (stats.live_blocks != 0)
+                      return 2;
+                  forced_memset(malloc(10), 0, 10);
+                  return static_cast<int>(deactivateOverthrower());
+              }),
+              1);
+    free(block);
+    EXPECT_EQ(deactivateOverthrower(), 0);
+
+    OverthrowerConfiguratorStep step_configurator(0);
+    OverthrowerConfiguratorNone::setEnv("OVERTHROWER_FORK_POLICY", 2U);
+    activateOverthrower();
+    EXPECT_EQ(forkedExitCode([]() {
+                  void* child_block = malloc(10);
+                  forced_memset(child_block, 0, 10);
+                  return child_block && deactivateOverthrower() == 0 ? 0 : 1;
+              }),
+              0);
+    EXPECT_EQ(malloc(10), nullptr);
+    EXPECT_EQ(deactivateOverthrower(), 0);
+}
+
+TEST(Overthrower, ForkWhileAllocating) // NOLINT
+{
+    // Locks of the registry are held by the other thread most of the time, a child never inherits them.
+    OverthrowerConfiguratorNone overthrower_configurator;
+    OverthrowerConfiguratorNone::setEnv("OVERTHROWER_FORK_POLICY", 1U); // A string of the other thread is not a leak of a child.
+    activateOverthrower();
+    std::atomic<bool> is_stopped{ false };
+    std::thread thread([&is_stopped]() {
+        while (!is_stopped) {
+            char* string = strdup("string");
+            forced_memset(string, 0, 6);
+            free(string);
+        }
+    });
+    for (int i = 0; i < 64; ++i) {
+        EXPECT_EQ(forkedExitCode([]() {
+                      for (int j = 0; j < 64; ++j)
+                          free(strdup("string"));
+                      return static_cast<int>(deactivateOverthrower());
+                  }),
+                  0);
+    }
+    is_stopped = true;
+    thread.join();
+    EXPECT_EQ(deactivateOverthrower(), 0);
+}
+
+TEST(Overthrower, StrategyCallbackSizeThreshold) // NOLINT
+{
+    OverthrowerConfiguratorNone overthrower_configurator;
+    OverthrowerSizeThreshold size_threshold{ 1000 };
+    setOverthrowerStrategy(overthrowerSizeThresholdStrategy, &size_threshold);
+    activateOverthrower();
+    void* small_block = malloc(999);
+    void* large_block = malloc(1000);
+    EXPECT_NE(small_block, nullptr);
+    EXPECT_EQ(large_block, nullptr);
+    free(small_block);
+    EXPECT_EQ(deactivateOverthrower(), 0);
+    setOverthrowerStrategy(nullptr, nullptr);
+}
+
+TEST(Overthrower, StrategyCallbackEveryNth) // NOLINT
+{
+    static constexpr unsigned int iterations = 64;
+
+    OverthrowerConfiguratorNone overthrower_configurator;
+    OverthrowerEveryNth every_nth{ 3, 2 };
+    std::string expected_pattern;
+    for (unsigned int i = 0; i < iterations; ++i)
+        expected_pattern.push_back(i >= every_nth.offset && (i - every_nth.offset) % every_nth.period == 0 ? '-' : '+');
+    std::string real_pattern(iterations, '?');
+    std::atomic<unsigned int> malloc_seq_num{};
+
+    setOverthrowerStrategy(overthrowerEveryNthStrategy, &every_nth);
+    activateOverthrower();
+    const unsigned int real_failure_count = failureCounter(iterations, real_pattern, &malloc_seq_num);
+    EXPECT_EQ(deactivateOverthrower(), 0);
+    setOverthrowerStrategy(nullptr, nullptr);
+
+    EXPECT_EQ(real_failure_count, std::count(expected_pattern.begin(), expected_pattern.end(), '-'));
+    EXPECT_EQ(real_pattern, expected_pattern);
+}
+
+TEST(Overthrower, StrategyCallbackComposite) // NOLINT
+{
+    struct ThreadFilter {
+        std::atomic<unsigned long> thread_id;
+    };
+
+    OverthrowerStrategyCallback thread_filter_strategy = [](unsigned int, size_t, unsigned long thread_id, unsigned int, void* user_data) -> int {
+        // Allocations done by a strategy itself are neither failed nor tracked.
+        free(malloc(16));
+        return thread_id == static_cast<ThreadFilter*>(user_data)->thread_id;
+    };
+
+    OverthrowerConfiguratorNone overthrower_configurator;
+    ThreadFilter thread_filter{ { 0UL } };
+    OverthrowerSizeThreshold size_threshold{ 1000 };
+    const OverthrowerStrategy strategies[] = { { overthrowerSizeThresholdStrategy, &size_threshold }, { thread_filter_strategy, &thread_filter } };
+    OverthrowerComposite composite{ strategies, 2, OVERTHROWER_COMPOSITE_ALL };
+
+    void* blocks[3] = {};
+    setOverthrowerStrategy(overthrowerCompositeStrategy, &composite);
+    activateOverthrower();
+    std::thread thread([&]() {
+        thread_filter.thread_id = static_cast<unsigned long>(reinterpret_cast<uintptr_t>(pthread_self()));
+        blocks[0] = malloc(100);
+        blocks[1] = malloc(1000);
+    });
+    thread.join();
+    blocks[2] = malloc(1000);
+    EXPECT_NE(blocks[0], nullptr);
+    EXPECT_EQ(blocks[1], nullptr);
+    EXPECT_NE(blocks[2], nullptr);
+    for (void* block : blocks)
+        free(block);
+    EXPECT_EQ(deactivateOverthrower(), 0);
+    setOverthrowerStrategy(nullptr, nullptr);
+}
+
 TEST(Overthrower, SettingErrno) // NOLINT
 {
     static const unsigned int iterations = 50;
@@ -748,6 +1839,83 @@ TEST(Overthrower, PreservingErrnoWithOverthrower) // NOLINT
     EXPECT_EQ(deactivateOverthrower(), 0);
 }
 
+#if defined(PLATFORM_OS_LINUX)
+static unsigned int g_new_handler_invocations = 0;
+
+static void newHandler()
+{
+    ++g_new_handler_invocations;
+    std::set_new_handler(nullptr);
+}
+
+TEST(Overthrower, OperatorNew) // NOLINT
+{
+    char* volatile block = nullptr;
+    {
+        OverthrowerConfiguratorStep overthrower_configurator(0);
+        activateOverthrower();
+        EXPECT_THROW(block = new char[10], std::bad_alloc);
+        block = new (std::nothrow) char[10];
+        EXPECT_EQ(block, nullptr);
+        EXPECT_EQ(deactivateOverthrower(), 0);
+    }
+    {
+        // A new handler is invoked once the first attempt fails, the second one succeeds.
+        OverthrowerConfiguratorPulse overthrower_configurator(0, 1);
+        std::set_new_handler(newHandler);
+        activateOverthrower();
+        block = new char[10];
+        forced_memset(block, 0, 10);
+        EXPECT_EQ(deactivateOverthrower(), 1);
+        delete[] block;
+        EXPECT_EQ(g_new_handler_invocations, 1U);
+        EXPECT_EQ(std::set_new_handler(nullptr), nullptr);
+    }
+}
+
+TEST(Overthrower, OperatorNewAligned) // NOLINT
+{
+    // Aligned variants are resolved by their mangled names, tests are built as C++11 which does not have std::align_val_t.
+    using AlignedNew = void* (*)(size_t, size_t);
+    using AlignedDelete = void (*)(void*, size_t);
+    const auto aligned_new = reinterpret_cast<AlignedNew>(dlsym(RTLD_DEFAULT, "_ZnwmSt11align_val_t"));
+    const auto aligned_delete = reinterpret_cast<AlignedDelete>(dlsym(RTLD_DEFAULT, "_ZdlPvSt11align_val_t"));
+    ASSERT_NE(aligned_new, nullptr);
+    ASSERT_NE(aligned_delete, nullptr);
+
+    OverthrowerConfiguratorPulse overthrower_configurator(1, 1);
+    activateOverthrower();
+    void* block = aligned_new(100, 256);
+    forced_memset(block, 0, 100);
+    EXPECT_THROW(aligned_new(100, 256), std::bad_alloc);
+    EXPECT_EQ(deactivateOverthrower(), 1);
+    aligned_delete(block, 256);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(block) % 256U, 0U);
+}
+
+TEST(Overthrower, OperatorNewCallSite) // NOLINT
+{
+    OverthrowerConfiguratorNone overthrower_configurator;
+    ReportFile report_file;
+    OverthrowerConfiguratorNone::setEnv("OVERTHROWER_LEAK_SITES", 1U);
+    activateOverthrower();
+    char* volatile block = new char[100];
+    forced_memset(block, 0, 100);
+    EXPECT_EQ(deactivateOverthrower(), 1);
+    delete[] block;
+
+    // The first frame of a call site is the code which has invoked new, not operator new of the standard library.
+    const std::string report = report_file.read();
+    const std::string header = "\n### 1 block, 100 bytes ###\n";
+    const size_t site = report.find(header);
+    ASSERT_NE(site, std::string::npos);
+    const size_t first_frame = site + header.size();
+    const std::string frame = report.substr(first_frame, report.find('\n', first_frame) - first_frame);
+    EXPECT_EQ(frame.find("libstdc++"), std::string::npos) << frame;
+    EXPECT_NE(frame.find("overthrower_tests"), std::string::npos) << frame;
+}
+#endif
+
 TEST(Overthrower, ThrowingException) // NOLINT
 {
     class CustomException : public std::exception {
@@ -844,6 +2012,73 @@ TEST(Overthrower, CreatingThreads) // NOLINT
 }
 #endif
 
+TEST(Overthrower, Calloc) // NOLINT
+{
+    static constexpr size_t count = 1024 * 1024;
+
+    OverthrowerConfiguratorStep overthrower_configurator(1);
+    activateOverthrower();
+    auto buffer = static_cast<uint32_t*>(calloc(count, sizeof(uint32_t)));
+    ASSERT_NE(buffer, nullptr);
+    EXPECT_TRUE(std::all_of(buffer, buffer + count, [](uint32_t value) { return value == 0; }));
+    errno = 0;
+    EXPECT_EQ(calloc(count, sizeof(uint32_t)), nullptr);
+    EXPECT_EQ(errno, ENOMEM);
+    // Overflow of the total size is reported without consulting a strategy.
+    volatile size_t huge_count = SIZE_MAX / 2U;
+    errno = 0;
+    EXPECT_EQ(calloc(huge_count, 4U), nullptr);
+    EXPECT_EQ(errno, ENOMEM);
+    EXPECT_EQ(deactivateOverthrower(), 1);
+    free(buffer);
+}
+
+TEST(Overthrower, AlignedAllocators) // NOLINT
+{
+    static constexpr size_t alignment = 64;
+
+    {
+        OverthrowerConfiguratorStep overthrower_configurator(0);
+        activateOverthrower();
+        void* buffer = reinterpret_cast<void*>(alignment);
+        errno = 0;
+        EXPECT_EQ(posix_memalign(&buffer, alignment, 128), ENOMEM);
+        EXPECT_EQ(buffer, reinterpret_cast<void*>(alignment));
+        EXPECT_EQ(errno, 0);
+        EXPECT_EQ(posix_memalign(&buffer, alignment + 1U, 128), EINVAL);
+        EXPECT_EQ(valloc(128), nullptr);
+#if defined(PLATFORM_OS_LINUX)
+        EXPECT_EQ(aligned_alloc(alignment, 128), nullptr);
+        EXPECT_EQ(memalign(alignment, 128), nullptr);
+#endif
+        EXPECT_EQ(deactivateOverthrower(), 0);
+    }
+
+    OverthrowerConfiguratorNone overthrower_configurator;
+    std::vector<void*> buffers;
+    buffers.reserve(4);
+    activateOverthrower();
+    void* buffer = nullptr;
+    ASSERT_EQ(posix_memalign(&buffer, alignment, 128), 0);
+    buffers.push_back(buffer);
+    buffers.push_back(valloc(128));
+#if defined(PLATFORM_OS_LINUX)
+    buffers.push_back(aligned_alloc(alignment, 128));
+    buffers.push_back(memalign(alignment, 128));
+#endif
+    for (void* pointer : buffers) {
+        ASSERT_NE(pointer, nullptr);
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(pointer) % alignment, 0U);
+        forced_memset(pointer, 0, 128);
+#if defined(PLATFORM_OS_LINUX)
+        EXPECT_GE(malloc_usable_size(pointer), 128U);
+#endif
+    }
+    EXPECT_EQ(deactivateOverthrower(), static_cast<unsigned int>(buffers.size()));
+    for (void* pointer : buffers)
+        free(pointer);
+}
+
 TEST(Overthrower, ReallocNonFailing) // NOLINT
 {
     static const size_t sizes[] = { 2,     4,     8,      16,     32,     64,      128,     256,     512,     1024,     2048,     4096,     8192,     16384,
@@ -946,6 +2181,29 @@ TEST(Overthrower, ReallocDeallocateWithOverthrower) // NOLINT
     EXPECT_EQ(deactivateOverthrower(), 0);
 }
 
+TEST(Overthrower, ReallocKeepsTracking) // NOLINT
+{
+    OverthrowerConfiguratorNone overthrower_configurator;
+    activateOverthrower();
+    void* buffer = malloc(1024);
+    ASSERT_NE(buffer, nullptr);
+    forced_memset(buffer, 0, 1024);
+    void* shrunk_buffer = realloc(buffer, 512);
+    ASSERT_NE(shrunk_buffer, nullptr);
+#if defined(PLATFORM_OS_LINUX)
+    // glibc shrinks blocks in place, the block must not be copied by overthrower.
+    EXPECT_EQ(shrunk_buffer, buffer);
+#endif
+    buffer = shrunk_buffer;
+    for (size_t size = 1024; size <= 1024 * 1024; size *= 2) {
+        buffer = realloc(buffer, size);
+        ASSERT_NE(buffer, nullptr);
+        forced_memset(buffer, 0, size);
+    }
+    EXPECT_EQ(deactivateOverthrower(), 1);
+    free(buffer);
+}
+
 TEST(Overthrower, ReallocGrowShrink) // NOLINT
 {
     constexpr unsigned int iteration_count = 128;
@@ -993,11 +2251,13 @@ TEST(Overthrower, ReallocGrowShrink) // NOLINT
 }
 
 extern "C" void* somePureCFunction();
+extern "C" int scopedPauseInPureC();
 
 TEST(Overthrower, PureC) // NOLINT
 {
     OverthrowerConfiguratorStep overthrower_configurator(0);
     ASSERT_EQ(somePureCFunction(), nullptr);
+    ASSERT_EQ(scopedPauseInPureC(), 0);
 }
 
 TEST(Overthrower, ImplicitDeactivation) // NOLINT
@@ -1055,6 +2315,51 @@ TEST(Overthrower, DlError) // NOLINT
 }
 #endif
 
+#if defined(PLATFORM_OS_LINUX)
+// Names of these functions are referred by OVERTHROWER_WHITELIST / OVERTHROWER_IGNORE_LIST, C linkage keeps them unmangled.
+extern "C" __attribute__((noinline)) void* userWhitelistedAllocation(size_t size)
+{
+    void* buffer = malloc(size);
+    if (buffer)
+        forced_memset(buffer, 0, size);
+    return buffer;
+}
+
+extern "C" __attribute__((noinline)) void* userIgnoredAllocation(size_t size)
+{
+    void* buffer = malloc(size);
+    if (buffer)
+        forced_memset(buffer, 0, size);
+    return buffer;
+}
+
+TEST(Overthrower, UserDefinedKnowledgeBase) // NOLINT
+{
+    OverthrowerConfiguratorStep overthrower_configurator(0);
+    OverthrowerConfiguratorStep::setEnv("OVERTHROWER_WHITELIST", "nonExistingFunction,userWhitelistedAllocation");
+    OverthrowerConfiguratorStep::setEnv("OVERTHROWER_IGNORE_LIST", "userIgnoredAllocation");
+    activateOverthrower();
+
+    void* whitelisted_buffer = userWhitelistedAllocation(128);
+    void* ignored_buffer = userIgnoredAllocation(128);
+    void* buffer = malloc(128);
+
+    // Whitelisted allocations are never failed, ignored ones are failed as usual but never treated as leaks.
+    EXPECT_EQ(deactivateOverthrower(), 0U);
+    EXPECT_NE(whitelisted_buffer, nullptr);
+    EXPECT_EQ(ignored_buffer, nullptr);
+    EXPECT_EQ(buffer, nullptr);
+    free(whitelisted_buffer);
+
+    OverthrowerConfiguratorNone::setEnv("OVERTHROWER_STRATEGY", STRATEGY_NONE);
+    activateOverthrower();
+    ignored_buffer = userIgnoredAllocation(128);
+    EXPECT_EQ(deactivateOverthrower(), 0U);
+    EXPECT_NE(ignored_buffer, nullptr);
+    free(ignored_buffer);
+}
+#endif
+
 TEST(Overthrower, SelfOverthrow) // NOLINT
 {
     constexpr unsigned int allocation_count = 16384U;
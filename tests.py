@@ -1,4 +1,7 @@
+from os import environ
+from os.path import dirname, join
 from subprocess import check_output, CalledProcessError, STDOUT
+from sys import executable
 from pytest import raises
 from re import match
 
@@ -24,3 +27,60 @@ def test_leaking_library():
     match_object = match(r'^0x[\da-f]{16}\s+-\s+\d+\s+-\s+(\d+)$', leaked_blocks[0])
     assert match_object is not None
     assert int(match_object.group(1)) == 731465028  # Exactly this amount of bytes is allocated and never freed at `leaking_library`.
+
+
+def test_leaking_library_target():
+    # The library is loaded after activation, its allocations are in scope only if it is the target.
+    env = dict(environ, OVERTHROWER_TARGET_LIBRARY='libleaking_library.so')
+    with raises(CalledProcessError) as exception_info:
+        check_output(['dynamic_loader'], stderr=STDOUT, env=env)
+    assert exception_info.value.returncode == 1
+    assert b'731465028' in exception_info.value.output
+
+    env['OVERTHROWER_TARGET_LIBRARY'] = 'libother_library.so'
+    check_output(['dynamic_loader'], stderr=STDOUT, env=env)
+
+
+def test_leaking_library_ignored():
+    # The library is loaded after activation, the knowledge base learns about its functions once they allocate.
+    env = dict(environ, OVERTHROWER_IGNORE_LIST='_GLOBAL__sub_I_leaking_library.cpp')
+    check_output(['dynamic_loader'], stderr=STDOUT, env=env)
+
+
+def test_quiet_mode():
+    assert b'waiting for the activation signal' in check_output(['overthrower_free_null'], stderr=STDOUT)
+
+    env = dict(environ, OVERTHROWER_QUIET='1')
+    assert check_output(['overthrower_free_null'], stderr=STDOUT, env=env) == b''
+
+    # Only informational messages are suppressed, reports are not.
+    with raises(CalledProcessError) as exception_info:
+        check_output(['dynamic_loader'], stderr=STDOUT, env=env)
+    assert b'activation signal' not in exception_info.value.output
+    assert b'overthrower has detected not freed memory blocks' in exception_info.value.output
+
+
+def write_snapshot(path, blocks, sites):
+    from snapshot_diff import HEADER, BLOCK, SITE, FRAME, MAGIC, VERSION
+    data = HEADER.pack(MAGIC, VERSION, BLOCK.size, len(blocks), len(sites))
+    data += b''.join(BLOCK.pack(*block) for block in blocks)
+    for site, stable_id, function in sites:
+        file_name, func_name = b'libtest.so', function.encode()
+        data += SITE.pack(site, 1, stable_id) + FRAME.pack(0x1000 + site, 0x10, len(file_name), len(func_name), 0) + file_name + func_name
+    path.write_bytes(data)
+
+
+def test_snapshot_diff(tmp_path):
+    older, newer = tmp_path / 'snapshot.1', tmp_path / 'snapshot.2'
+    # Slots of the call site cache have been reused by another activation: 1 and 2 have swapped their call sites.
+    write_snapshot(older, [(0x100, 10, 0, 1), (0x200, 20, 1, 2), (0x300, 30, 2, 2)], [(1, 0xCAC4E, 'cache'), (2, 0xBA55E, 'parser')])
+    write_snapshot(newer, [(0x100, 10, 0, 2), (0x200, 20, 1, 1), (0x400, 4000, 5, 2), (0x500, 50, 6, 3)],
+                   [(2, 0xCAC4E, 'cache'), (1, 0xBA55E, 'parser'), (3, 0x9E9E, 'queue')])
+
+    output = check_output([executable, join(dirname(__file__), 'snapshot_diff.py'), str(older), str(newer)]).decode().splitlines()
+    assert output[0] == 'Heap has changed by +4020 bytes, +1 blocks.'
+    headers = [line for line in output if line.startswith('###')]
+    assert headers == ['### +4000 bytes, +1 blocks (1 new, 4010 bytes in 2 blocks now) ###',
+                       '### +50 bytes, +1 blocks (1 new, 50 bytes in 1 blocks now) ###',
+                       '### -30 bytes, -1 blocks (0 new, 20 bytes in 1 blocks now) ###']
+    assert output[output.index(headers[0]) + 1] == '#0  0x0000000000001002 libtest.so - cache + 0x10'